@@ -1,21 +1,67 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "vsfsck.h"
 
+// <linux/io_uring.h> pulls in <linux/fs.h>, which has a 1 KiB BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 #define BLOCK_SIZE 4096
-#define TOTAL_BLOCKS 64
 #define SUPERBLOCK_BLOCK_NO 0
-#define INODE_BITMAP_BLOCK_NO 1
-#define DATA_BITMAP_BLOCK_NO 2
-#define INODE_TABLE_START_BLOCK 3
-#define INODE_TABLE_BLOCKS 5
-#define DATA_BLOCK_START 8
 #define INODE_SIZE 256
 #define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
-#define MAX_INODES (INODES_PER_BLOCK * INODE_TABLE_BLOCKS)
-#define MAX_DATA_BLOCKS (TOTAL_BLOCKS - DATA_BLOCK_START)
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK (BLOCK_SIZE / 8)
+#define BITSET_WORDS(n) (((size_t)(n) + 63) / 64)
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+// Longest run of contiguous blocks issued as one write during repair
+#define WRITE_RUN_BLOCKS 256
+// Checks of a live image are repeated at most this many times until one sees a stable state
+#define SNAPSHOT_ATTEMPTS 5
+// Bitset words the block pass tests at once before asking the checks about each word
+#define BLOCK_CHUNK_WORDS 64
+// Most reads the asynchronous reader keeps in flight
+#define MAX_QUEUE_DEPTH 4096
+// Most threads one check runs at once
+#define MAX_JOBS 1024
+
+// Directory data is an array of fixed-size entries; an entry with an empty name is free
+#define DIR_ENTRY_SIZE 32
+#define DIR_NAME_LENGTH (DIR_ENTRY_SIZE - sizeof(uint32_t))
+#define ROOT_INODE 0
+
+// Longest run of contiguous data blocks read with one call during a deep scan
+#define DEEP_SCAN_RUN_BLOCKS 64
+// Longest run of inode table blocks read with one call in direct mode
+#define INODE_TABLE_RUN_BLOCKS 256
+// Blocks read from a stream per call while spooling it
+#define STREAM_CHUNK_BLOCKS 256
+
+// Default layout, used when the superblock geometry cannot be trusted
+#define DEFAULT_TOTAL_BLOCKS 64
+#define DEFAULT_INODE_BITMAP_BLOCK 1
+#define DEFAULT_DATA_BITMAP_BLOCK 2
+#define DEFAULT_INODE_TABLE_START 3
+#define DEFAULT_DATA_BLOCK_START 8
+#define DEFAULT_INODE_COUNT (INODES_PER_BLOCK * (DEFAULT_DATA_BLOCK_START - DEFAULT_INODE_TABLE_START))
 
 /**
  * Superblock structure representing the filesystem metadata.
@@ -54,250 +100,4438 @@ typedef struct {
     char reserved[156];
 } __attribute__((packed)) Inode;
 
-// Global arrays to track block and inode usage
-bool dataBitmap[MAX_DATA_BLOCKS];
-bool dataBlockUsed[MAX_DATA_BLOCKS];
-int blockRefCount[MAX_DATA_BLOCKS];
-bool inodeBitmap[MAX_INODES];
-bool inodeUsed[MAX_INODES];
+/**
+ * Directory entry. The name is NUL-padded and not NUL-terminated when it fills
+ * the field. Every directory holds "." and ".." entries.
+ */
+typedef struct {
+    uint32_t inode;
+    char name[DIR_NAME_LENGTH];
+} __attribute__((packed)) DirEntry;
 
-//reads a block from the filesystem image into the provided buffer.
-void readBlock(FILE *fp, int blockNum, void *buffer) {
-    fseek(fp, blockNum * BLOCK_SIZE, SEEK_SET);
-    fread(buffer, BLOCK_SIZE, 1, fp);
+/**
+ * Handle to an opened filesystem image. Blocks are read with pread so the handle
+ * can be shared by worker threads. In mapped mode the whole file is mapped
+ * read-only and blocks are viewed in place instead of copied. holes marks the
+ * first holeBlocks blocks that lie entirely in holes of a sparse image file.
+ * In direct mode the file is opened with O_DIRECT, so reads bypass the page cache
+ * and must land in block-aligned memory.
+ */
+typedef struct {
+    int fd;
+    bool direct;
+    uint8_t *map;
+    size_t mapSize;
+    uint64_t size;
+    uint64_t *holes;
+    uint64_t holeBlocks;
+} Image;
+
+/**
+ * Filesystem layout derived from the superblock. Block numbers are absolute;
+ * data block pointers in inodes are relative to dataBlockStart.
+ */
+typedef struct {
+    uint32_t totalBlocks;
+    uint32_t inodeBitmapBlock;
+    uint32_t inodeBitmapBlocks;
+    uint32_t dataBitmapBlock;
+    uint32_t dataBitmapBlocks;
+    uint32_t inodeTableStart;
+    uint32_t inodeTableBlocks;
+    uint32_t dataBlockStart;
+    uint32_t inodeCount;
+    uint32_t dataBlockCount;
+} Geometry;
+
+/**
+ * Every kind of finding the checker can report. The names are the stable check
+ * ids used in structured output.
+ */
+typedef enum {
+    CHECK_SUPERBLOCK_MAGIC,
+    CHECK_SUPERBLOCK_BLOCK_SIZE,
+    CHECK_SUPERBLOCK_TOTAL_BLOCKS,
+    CHECK_SUPERBLOCK_LAYOUT,
+    CHECK_SUPERBLOCK_INODE_SIZE,
+    CHECK_SUPERBLOCK_INODE_COUNT,
+    CHECK_INODE_MARKED_INVALID,
+    CHECK_INODE_VALID_UNMARKED,
+    CHECK_BLOCK_NOT_IN_BITMAP,
+    CHECK_INDIRECT_BAD_ENTRY,
+    CHECK_DATA_BITMAP_UNUSED,
+    CHECK_DATA_BITMAP_UNMARKED,
+    CHECK_DUPLICATE_BLOCK,
+    CHECK_BAD_DIRECT,
+    CHECK_BAD_INDIRECT,
+    CHECK_BAD_DOUBLE_INDIRECT,
+    CHECK_BAD_TRIPLE_INDIRECT,
+    CHECK_INODE_BLOCK_COUNT,
+    CHECK_INODE_SIZE,
+    CHECK_ROOT_NOT_DIRECTORY,
+    CHECK_DIR_BAD_ENTRY,
+    CHECK_DIR_FREE_ENTRY,
+    CHECK_DIR_DOT_ENTRY,
+    CHECK_DIR_MULTIPLE_PARENTS,
+    CHECK_DIR_CYCLE,
+    CHECK_ORPHAN_INODE,
+    CHECK_LINK_COUNT,
+    CHECK_DATA_CHECKSUM,
+    CHECK_INODE_BITMAP_COUNT,
+    CHECK_DATA_BITMAP_COUNT,
+    CHECK_COUNT
+} Check;
+
+static const char *checkNames[CHECK_COUNT] = {
+    "superblock-magic",
+    "superblock-block-size",
+    "superblock-total-blocks",
+    "superblock-layout",
+    "superblock-inode-size",
+    "superblock-inode-count",
+    "inode-marked-invalid",
+    "inode-valid-unmarked",
+    "block-not-in-bitmap",
+    "indirect-bad-entry",
+    "data-bitmap-unused",
+    "data-bitmap-unmarked",
+    "duplicate-block",
+    "bad-direct",
+    "bad-indirect",
+    "bad-double-indirect",
+    "bad-triple-indirect",
+    "inode-block-count",
+    "inode-size",
+    "root-not-directory",
+    "directory-bad-entry",
+    "directory-free-entry",
+    "directory-dot-entry",
+    "directory-multiple-parents",
+    "directory-cycle",
+    "orphan-inode",
+    "link-count",
+    "data-checksum",
+    "inode-bitmap-count",
+    "data-bitmap-count",
+};
+
+static const VsfsckFailure checkClasses[CHECK_COUNT] = {
+    VSFSCK_FAILURE_SUPERBLOCK,
+    VSFSCK_FAILURE_SUPERBLOCK,
+    VSFSCK_FAILURE_SUPERBLOCK,
+    VSFSCK_FAILURE_SUPERBLOCK,
+    VSFSCK_FAILURE_SUPERBLOCK,
+    VSFSCK_FAILURE_SUPERBLOCK,
+    VSFSCK_FAILURE_INODE,
+    VSFSCK_FAILURE_INODE,
+    VSFSCK_FAILURE_BITMAP,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_BITMAP,
+    VSFSCK_FAILURE_BITMAP,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_INODE,
+    VSFSCK_FAILURE_INODE,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_CHECKSUM,
+    VSFSCK_FAILURE_BITMAP,
+    VSFSCK_FAILURE_BITMAP,
+};
+
+// A finding, or a status line when check is -1, held back by a buffering reporter
+typedef struct {
+    int check;
+    int64_t inode;
+    int64_t block;
+    uint64_t count;
+    char *message;
+} ReportEvent;
+
+/**
+ * Destination for findings along with a per-check count of what was written.
+ * Findings and status lines go to callbacks, or are buffered in events while
+ * callbacks is NULL. Once limit findings (0 for no limit) have been written the
+ * reporter is full: further findings are dropped and the scans stop at their
+ * next checkpoint.
+ */
+typedef struct {
+    const VsfsckCallbacks *callbacks;
+    ReportEvent *events;
+    size_t eventCount;
+    size_t eventCapacity;
+    uint64_t counts[CHECK_COUNT];
+    uint64_t total;
+    uint64_t limit;
+    // Set when state sized from the image did not fit in memory; see imageCalloc()
+    bool outOfMemory;
+} Reporter;
+
+// Checker phases, timed and instrumented for the summary and --stats
+typedef enum {
+    PHASE_SUPERBLOCK,
+    PHASE_BITMAPS,
+    PHASE_INODE_TABLE,
+    PHASE_INODES,
+    PHASE_BLOCKS,
+    PHASE_DIRECTORIES,
+    PHASE_CHECKSUMS,
+    PHASE_BITMAP_COUNTS,
+    PHASE_REPAIR,
+    PHASE_COUNT
+} Phase;
+
+static const char *phaseNames[PHASE_COUNT] = {
+    "readSuperblock",
+    "loadBitmap",
+    "loadInodeTable",
+    "checkInodes",
+    "visitDataBlocks",
+    "checkDirectories",
+    "checkDataChecksums",
+    "checkBitmapCounts",
+    "repairImage",
+};
+
+// Counters are bumped atomically because scan workers share them
+typedef VsfsckPhaseStats PhaseStats;
+
+_Static_assert(CHECK_COUNT == VSFSCK_CHECK_COUNT && PHASE_COUNT == VSFSCK_PHASE_COUNT,
+               "vsfsck.h is out of date");
+
+// Kinds of indirect tree walk events, recorded for incremental checking
+enum {
+    WALK_LEAF,
+    WALK_DESCEND,
+    WALK_SKIP,
+    WALK_BAD_ENTRY
+};
+
+/**
+ * One step of an indirect tree walk. head packs the event kind above the inode's
+ * slot within its inode table block; block is the referenced data block (or the
+ * bad entry, with the indirect block holding it in extra). For any other event,
+ * extra is the index within the file of the first block it maps.
+ */
+typedef struct {
+    uint32_t head;
+    uint32_t block;
+    uint32_t extra;
+} WalkEvent;
+
+/**
+ * The indirect tree walks of a scan grouped by inode table block, with a checksum
+ * of each inode table block and one of the indirect blocks its inodes' walks
+ * descended into, in walk order. This is the derived reachability kept in the
+ * incremental state file: an inode table block whose checksums are unchanged is
+ * replayed from its events instead of walking its inodes' trees again.
+ */
+typedef struct {
+    WalkEvent *events;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t *blockStart;
+    uint64_t *checksums;
+    uint64_t *treeChecksums;
+    uint32_t blocks;
+} WalkLog;
+
+#define STATE_MAGIC 0x34534b4353465356ULL
+
+// Header of the incremental state file, followed by the checksums, the tree
+// checksums, the per-block event offsets and the events of a WalkLog
+typedef struct {
+    uint64_t magic;
+    uint32_t totalBlocks;
+    uint32_t inodeBitmapBlock;
+    uint32_t dataBitmapBlock;
+    uint32_t inodeTableStart;
+    uint32_t dataBlockStart;
+    uint32_t inodeCount;
+    uint32_t blocks;
+    uint32_t reserved;
+    uint64_t eventCount;
+} StateHeader;
+
+/**
+ * What the tree walk of the current inode found, checked against its blocks and
+ * size fields. partial is set when part of the tree could not be followed (a bad
+ * pointer, or an indirect block already walked for another reference), in which
+ * case the fields are not checked.
+ */
+typedef struct {
+    uint32_t blocks;
+    // One past the highest file block index mapped by an indirect tree
+    uint64_t endBlock;
+    bool partial;
+} FileTally;
+
+/**
+ * Reverse map from shared data blocks to the pointers that reference them. The inode
+ * scan records each pointer to a block it has already seen; the first pointer to a
+ * shared block is only known to matter afterwards, and collectBlockOwners() walks
+ * the trees again just until it has found them all. Owners are appended to one flat
+ * arena, which is sorted by block afterwards, so the map costs nothing per block
+ * when duplicates are rare.
+ */
+typedef struct {
+    uint32_t block;
+    uint32_t inode;
+    // Indirect block holding the pointer, or NO_OWNER_PARENT for a pointer in the inode
+    uint32_t parent;
+    // Entry within parent, or for pointers in the inode 0 = direct .. 3 = triple indirect
+    uint32_t slot;
+} BlockOwner;
+
+#define NO_OWNER_PARENT UINT32_MAX
+
+// A block that a scan worker's range references but an earlier range referenced first.
+// The worker could not tell, so its first pointer to the block went unrecorded
+typedef struct {
+    // First inode of the worker's range
+    uint32_t inode;
+    uint32_t block;
+} RangeFirst;
+
+typedef struct {
+    BlockOwner *owners;
+    size_t count;
+    size_t capacity;
+    RangeFirst *rangeFirsts;
+    size_t rangeFirstCount;
+    size_t rangeFirstCapacity;
+    // Blocks marked so far, to walk each indirect block once as the inode scan does
+    uint64_t *used;
+    // Blocks whose next pointer is still unrecorded, and the number of such pointers
+    uint64_t *wanted;
+    uint64_t remaining;
+} OwnerMap;
+
+/**
+ * Data block usage written by an inode scan. The serial scan points this at the
+ * context's bitsets; each parallel worker gets private shards that are merged in
+ * inode order afterwards. descended records the indirect blocks a worker walked
+ * so the merge can detect walks the serial scan would have skipped.
+ */
+typedef struct {
+    uint64_t *used;
+    uint64_t *shared;
+    uint64_t *descended;
+    Reporter *reporter;
+    WalkLog *log;
+    // Pointers to blocks already in used
+    OwnerMap *owners;
+    FileTally tally;
+} ScanState;
+
+/**
+ * Fused check engine. Rather than looping over the image itself, each check
+ * registers visitors and the engine calls them from its inode and block passes:
+ *  - visitInode for every inode in inode order, right after the inode scan has
+ *    walked its trees (inside the scan workers when -j is given, so findings keep
+ *    the serial order);
+ *  - prepareBlocks once the inode pass is complete, then visitBlock for every data
+ *    block the check's blockMask selects, in block order;
+ *  - finish once at the end, for status lines.
+ * Any visitor may be NULL. Adding a check adds callbacks, not passes.
+ */
+typedef struct {
+    void (*visitInode)(VsfsckContext *ctx, ScanState *state, uint32_t i, const Inode *inode, bool isValid);
+    void (*prepareBlocks)(VsfsckContext *ctx, Image *img);
+    // The blocks among the 64 starting at w * 64 that visitBlock wants to see. Only blocks
+    // whose bitmap bit disagrees with their use, or that are shared, may be selected
+    uint64_t (*blockMask)(const VsfsckContext *ctx, size_t w);
+    void (*visitBlock)(VsfsckContext *ctx, uint32_t block);
+    void (*finish)(VsfsckContext *ctx);
+} CheckVisitors;
+
+#define MAX_CHECKS 16
+
+/**
+ * Snapshot mode records the hash of every block read during a check. Afterwards
+ * the blocks are read again: if none changed, the report describes one
+ * point-in-time state of a live image; otherwise the check is repeated.
+ */
+typedef struct {
+    uint32_t block;
+    uint64_t hash;
+} SnapshotRead;
+
+/**
+ * Asynchronous block reader. Blocks a walk will need soon are queued ahead of
+ * use and read by io_uring, or by a pool of pread threads where io_uring is not
+ * available, keeping up to depth reads in flight. viewBlock() takes a queued
+ * block out of its slot, waiting for the read if it has not completed yet, and
+ * falls back to a plain pread for blocks that were never queued. Slots whose
+ * block was never taken are reused once the slots run out. All state is guarded
+ * by lock, so the scan workers of a context share one reader.
+ */
+typedef enum {
+    SLOT_FREE,
+    SLOT_QUEUED,
+    SLOT_READING,
+    SLOT_READY,
+} SlotState;
+
+typedef struct {
+    uint32_t block;
+    SlotState state;
+    // Next slot in the same hash bucket, or -1
+    int next;
+    ssize_t result;
+} ReadSlot;
+
+typedef struct {
+    // Reads kept in flight; 0 when the reader is not running
+    int depth;
+    int fd;
+    // Holes are never queued
+    const Image *img;
+    bool uring;
+    int slotCount;
+    ReadSlot *slots;
+    uint8_t *buffers;
+    int *buckets;
+    uint32_t bucketMask;
+    int inFlight;
+    // Next slot considered for reuse
+    int hand;
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+
+    // Thread pool engine: FIFO of queued slots
+    pthread_cond_t queued;
+    int *queue;
+    int queueHead;
+    int queueCount;
+    pthread_t *threads;
+    int threadCount;
+    bool stopping;
+
+    // io_uring engine
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;
+} AsyncReader;
+
+/**
+ * State of one checker. Every function that checks an image works on a context
+ * rather than on globals, so separate contexts can check separate images at once.
+ */
+struct VsfsckContext {
+    VsfsckCallbacks callbacks;
+    Geometry geo;
+    // Packed bitsets (64 bits per word) to track block and inode usage, sized from the geometry.
+    // dataBlockShared marks blocks referenced more than once.
+    uint64_t *dataBitmap;
+    uint64_t *dataBlockUsed;
+    uint64_t *dataBlockShared;
+    uint64_t *inodeBitmap;
+    uint64_t *inodeUsed;
+    // All five bitsets are slices of one allocation that is kept and cleared between images
+    uint64_t *trackingWords;
+    size_t trackingCapacity;
+    // Inode table cache: each inode table block is read once and shared by every per-inode check
+    uint8_t *inodeTableCache;
+    size_t inodeTableCacheBlocks;
+    // Points at the cache, or directly into the image in mapped mode
+    const uint8_t *inodeTable;
+
+    Reporter reporter;
+    PhaseStats phaseStats[PHASE_COUNT];
+    Phase currentPhase;
+    double phaseStartTime;
+
+    // Walk log loaded from the state file, and the one recorded by this run
+    WalkLog previousLog;
+    WalkLog currentLog;
+    uint64_t replayedBlocks;
+
+    const CheckVisitors *checkRegistry[MAX_CHECKS];
+    int checkRegistryCount;
+    // Owners of the shared blocks, gathered before the block pass, and the next one to report
+    OwnerMap duplicateOwners;
+    size_t nextDuplicateOwner;
+
+    // Report runs of bitmap findings as ranges instead of one finding per bit
+    bool reportRanges;
+
+    AsyncReader reader;
+    // Block-aligned buffers that direct reads into unaligned buffers bounce through
+    uint8_t **alignedBlocks;
+    size_t alignedBlockCount;
+    size_t alignedBlockCapacity;
+    pthread_mutex_t alignedBlockLock;
+
+    bool snapshotting;
+    SnapshotRead *snapshotReads;
+    size_t snapshotCount;
+    size_t snapshotCapacity;
+    pthread_mutex_t snapshotLock;
+};
+
+//Adds a check to the engine; visitors run in registration order.
+static void registerCheck(VsfsckContext *ctx, const CheckVisitors *check) {
+    if (ctx->checkRegistryCount == MAX_CHECKS) {
+        fprintf(stderr, "Too many checks registered.\n");
+        exit(EXIT_FAILURE);
+    }
+    ctx->checkRegistry[ctx->checkRegistryCount++] = check;
 }
 
-//Loads a bitmap from a specified block into a boolean array.
-void loadBitmap(FILE *fp, int blockNum, bool *bitmap, int count) {
-    uint8_t rawBitmap[BLOCK_SIZE];
-    readBlock(fp, blockNum, rawBitmap);
-    for (int i = 0; i < count; i++) {
-        bitmap[i] = (rawBitmap[i / 8] >> (i % 8)) & 1;
+//Allocates zeroed memory or exits if the image is too large to track.
+static void *xcalloc(size_t count, size_t size) {
+    void *p = calloc(count ? count : 1, size);
+    if (!p) {
+        perror("Failed to allocate checker state");
+        exit(EXIT_FAILURE);
     }
+    return p;
 }
-//Feature 1: Superblock Validates the superblock fields and prints errors if any are invalid.
-void readSuperblock(FILE *fp, Superblock *superblock) {
-    readBlock(fp, SUPERBLOCK_BLOCK_NO, superblock);
 
-    if (superblock->magic != 0xD34D) {
-        printf("ERROR: Invalid magic number in superblock.\n");
+//Allocates zeroed memory aligned to BLOCK_SIZE, as direct I/O requires, or exits.
+static void *xalignedAlloc(size_t count, size_t size) {
+    void *p;
+    size_t bytes = (count ? count : 1) * size;
+    if (posix_memalign(&p, BLOCK_SIZE, bytes) != 0) {
+        errno = ENOMEM;
+        perror("Failed to allocate checker state");
+        exit(EXIT_FAILURE);
     }
-    if (superblock->blockSize != BLOCK_SIZE) {
-        printf("ERROR: Invalid block size in superblock.\n");
+    memset(p, 0, bytes);
+    return p;
+}
+
+/**
+ * Allocates zeroed memory for state whose size the image decides. Unlike xcalloc()
+ * this does not exit: if there is not enough, the reporter is marked out of memory
+ * and NULL is returned. The phase at hand gives up, runChecks() skips the rest and
+ * vsfsckCheck() fails with ENOMEM.
+ */
+static void *imageCalloc(Reporter *reporter, size_t count, size_t size) {
+    void *p = calloc(count ? count : 1, size);
+    if (!p) {
+        reporter->outOfMemory = true;
     }
-    if (superblock->totalBlocks != TOTAL_BLOCKS) {
-        printf("ERROR: Invalid total block count in superblock.\n");
+    return p;
+}
+
+//Like imageCalloc(), but aligned to BLOCK_SIZE as direct I/O requires.
+static void *imageAlignedAlloc(Reporter *reporter, size_t count, size_t size) {
+    void *p;
+    size_t bytes = (count ? count : 1) * size;
+    if (posix_memalign(&p, BLOCK_SIZE, bytes) != 0) {
+        reporter->outOfMemory = true;
+        return NULL;
     }
+    memset(p, 0, bytes);
+    return p;
+}
 
-    if (superblock->inodeBitmapBlock != INODE_BITMAP_BLOCK_NO ||
-        superblock->dataBitmapBlock != DATA_BITMAP_BLOCK_NO ||
-        superblock->inodeTableStart != INODE_TABLE_START_BLOCK ||
-        superblock->dataBlockStart != DATA_BLOCK_START) {
-        printf("ERROR: One or more superblock pointers are incorrect.\n");
+//Doubles the capacity of a growing array of size-byte items, starting at initial.
+//Returns the moved array, or NULL with the array untouched as imageCalloc() does.
+static void *growArray(Reporter *reporter, void *items, size_t *capacity, size_t size, size_t initial) {
+    size_t wanted = *capacity ? *capacity * 2 : initial;
+    void *grown = realloc(items, wanted * size);
+    if (!grown) {
+        reporter->outOfMemory = true;
+        return NULL;
     }
+    *capacity = wanted;
+    return grown;
+}
 
-    if (superblock->inodeSize != INODE_SIZE) {
-        printf("ERROR: Invalid inode size in superblock.\n");
+//Takes a block-aligned buffer from the context's pool, allocating one if the pool is empty.
+static uint8_t *takeAlignedBlock(VsfsckContext *ctx) {
+    uint8_t *block = NULL;
+    pthread_mutex_lock(&ctx->alignedBlockLock);
+    if (ctx->alignedBlockCount > 0) {
+        block = ctx->alignedBlocks[--ctx->alignedBlockCount];
     }
-    if (superblock->inodeCount > MAX_INODES) {
-        printf("ERROR: Inode count in superblock exceeds maximum allowed.\n");
+    pthread_mutex_unlock(&ctx->alignedBlockLock);
+    return block ? block : xalignedAlloc(1, BLOCK_SIZE);
+}
+
+//Returns a buffer to the pool, which keeps it for the next image.
+static void returnAlignedBlock(VsfsckContext *ctx, uint8_t *block) {
+    pthread_mutex_lock(&ctx->alignedBlockLock);
+    if (ctx->alignedBlockCount == ctx->alignedBlockCapacity) {
+        ctx->alignedBlockCapacity = ctx->alignedBlockCapacity ? ctx->alignedBlockCapacity * 2 : 16;
+        ctx->alignedBlocks = realloc(ctx->alignedBlocks, ctx->alignedBlockCapacity * sizeof(uint8_t *));
+        if (!ctx->alignedBlocks) {
+            perror("Failed to allocate checker state");
+            exit(EXIT_FAILURE);
+        }
     }
+    ctx->alignedBlocks[ctx->alignedBlockCount++] = block;
+    pthread_mutex_unlock(&ctx->alignedBlockLock);
 }
 
-/**
- * Checks all inodes for validity and consistency with inode bitmap.
- * Updates global arrays tracking used inodes and data blocks.
- */
-void checkInodes(FILE *fp) {
-    Inode inode;
-    uint8_t blockBuffer[BLOCK_SIZE];
+static double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    for (int i = 0; i < MAX_INODES; i++) {
-        int blockNum = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-        int offset = (i * INODE_SIZE) % BLOCK_SIZE;
+static void beginPhase(VsfsckContext *ctx, Phase phase) {
+    ctx->currentPhase = phase;
+    ctx->phaseStartTime = monotonicSeconds();
+}
 
-        readBlock(fp, blockNum, blockBuffer);
-        memcpy(&inode, blockBuffer + offset, sizeof(Inode));
+static void endPhase(VsfsckContext *ctx) {
+    ctx->phaseStats[ctx->currentPhase].seconds += monotonicSeconds() - ctx->phaseStartTime;
+}
 
-        bool isValid = (inode.links > 0 && inode.dtime == 0);
+//Adds n to one of the current phase's I/O counters.
+static void countIo(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
 
-        if (inodeBitmap[i] && !isValid) {
-            printf("ERROR: Inode %d marked used in bitmap but is invalid.\n", i);
-        }
+static bool reporterFull(const Reporter *reporter) {
+    return reporter->limit && reporter->total >= reporter->limit;
+}
 
-        if (!inodeBitmap[i] && isValid) {
-            printf("ERROR: Inode %d is valid but not marked used in bitmap.\n", i);
+//Returns the most severe class among the findings counted by reporter.
+static VsfsckFailure worstFailure(const Reporter *reporter) {
+    VsfsckFailure worst = VSFSCK_FAILURE_NONE;
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        if (reporter->counts[c] && (worst == VSFSCK_FAILURE_NONE || checkClasses[c] < worst)) {
+            worst = checkClasses[c];
         }
+    }
+    return worst;
+}
 
-        if (isValid) {
-            inodeUsed[i] = true;
-
-            // Check direct block reference
-            if (inode.direct >= MAX_DATA_BLOCKS) {
-                printf("ERROR: Inode %d has invalid direct block %u.\n", i, inode.direct);
-            } else {
-                dataBlockUsed[inode.direct] = true;
-                blockRefCount[inode.direct]++;
-                if (!dataBitmap[inode.direct]) {
-                    printf("ERROR: Inode %d references block %u not marked in data bitmap.\n", i, inode.direct);
-                }
+//Hands a finding (or a status line, for check -1) to the reporter's callbacks, or
+//buffers a copy of it while the reporter has none.
+static void deliverEvent(Reporter *reporter, int check, int64_t inode, int64_t block, uint64_t count, const char *message) {
+    const VsfsckCallbacks *callbacks = reporter->callbacks;
+    if (!callbacks) {
+        char *copy = strdup(message);
+        if (!copy) {
+            reporter->outOfMemory = true;
+            return;
+        }
+        if (reporter->eventCount == reporter->eventCapacity) {
+            ReportEvent *events = growArray(reporter, reporter->events, &reporter->eventCapacity, sizeof(ReportEvent), 64);
+            if (!events) {
+                free(copy);
+                return;
             }
+            reporter->events = events;
         }
+        ReportEvent *event = &reporter->events[reporter->eventCount++];
+        event->check = check;
+        event->inode = inode;
+        event->block = block;
+        event->count = count;
+        event->message = copy;
+        return;
+    }
+    if (check < 0) {
+        if (callbacks->status) {
+            callbacks->status(callbacks->user, message);
+        }
+    } else if (callbacks->finding) {
+        VsfsckFinding finding = { checkNames[check], inode, block, count, message };
+        callbacks->finding(callbacks->user, &finding);
     }
 }
 
-/**
- * Checks the consistency of the data bitmap against actual data block usage.
- */
-/**
- * Feature 2: Data Bitmap Consistency Checker
- * Checks the consistency of the data bitmap against actual data block usage.
- */
-void checkDataBitmap() {
-    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-        if (dataBitmap[i] && !dataBlockUsed[i]) {
-            printf("ERROR: Data block %d marked used in bitmap but not referenced.\n", i);
-        }
+//Passes the events buffered by from on to to, in report order, and empties from.
+static void moveEvents(Reporter *from, Reporter *to) {
+    for (size_t k = 0; k < from->eventCount; k++) {
+        const ReportEvent *event = &from->events[k];
+        deliverEvent(to, event->check, event->inode, event->block, event->count, event->message);
+        free(event->message);
+    }
+    from->eventCount = 0;
+}
 
-        if (!dataBitmap[i] && dataBlockUsed[i]) {
-            printf("ERROR: Data block %d is used but not marked in bitmap.\n", i);
-        }
+//Drops the events buffered by reporter.
+static void clearEvents(Reporter *reporter) {
+    for (size_t k = 0; k < reporter->eventCount; k++) {
+        free(reporter->events[k].message);
+    }
+    reporter->eventCount = 0;
+}
 
-        if (blockRefCount[i] > 1) {
-            printf("ERROR: Data block %d is referenced by multiple inodes.\n", i);
+//Counts count findings of one check and reports them as one, which covers count
+//consecutive inodes or blocks from the given one.
+static void reportFindings(Reporter *reporter, Check check, uint64_t count, int64_t inode, int64_t block, const char *format,
+                    va_list args) {
+    if (reporterFull(reporter)) {
+        return;
+    }
+    // Messages are short except for owner lists, which get a heap buffer; without
+    // memory for one the list is cut short
+    char buffer[256];
+    char *message = buffer;
+    va_list retry;
+    va_copy(retry, args);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (length >= (int)sizeof(buffer)) {
+        char *longer = calloc((size_t)length + 1, 1);
+        if (longer) {
+            message = longer;
+            vsnprintf(message, (size_t)length + 1, format, retry);
         }
     }
+    va_end(retry);
+    reporter->counts[check] += count;
+    reporter->total += count;
+    deliverEvent(reporter, check, inode, block, count, message);
+    if (message != buffer) {
+        free(message);
+    }
+}
+
+//Reports one finding about the given inode and block, either of which may be -1.
+static void reportFinding(Reporter *reporter, Check check, int64_t inode, int64_t block, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportFindings(reporter, check, 1, inode, block, format, args);
+    va_end(args);
+}
+
+//Cuts a run of length findings short so that it ends at the error limit. Returns 0
+//once the limit is reached.
+static uint32_t clipRange(const Reporter *reporter, uint32_t length) {
+    if (reporter->limit && reporter->total + length > reporter->limit) {
+        return reporter->total < reporter->limit ? (uint32_t)(reporter->limit - reporter->total) : 0;
+    }
+    return length;
+}
+
+//Reports a run of count findings of one check as one, already cut short by clipRange().
+//Exactly one of inode and block is the start of the run.
+static void reportRange(Reporter *reporter, Check check, uint64_t count, int64_t inode, int64_t block, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportFindings(reporter, check, count, inode, block, format, args);
+    va_end(args);
+}
+
+//Reports a progress or all-clear line.
+static void reportStatus(VsfsckContext *ctx, const char *message) {
+    deliverEvent(&ctx->reporter, -1, -1, -1, 0, message);
+}
+
+//Passes a note about the check itself, such as a fallback or an unwritable side file,
+//to the diagnostic callback.
+static void reportDiagnostic(VsfsckContext *ctx, const char *format, ...) {
+    if (!ctx->callbacks.diagnostic) {
+        return;
+    }
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    ctx->callbacks.diagnostic(ctx->callbacks.user, message);
+}
+
+static bool testBit(const uint64_t *set, uint32_t i) {
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static void setBit(uint64_t *set, uint32_t i) {
+    set[i / 64] |= 1ULL << (i % 64);
+}
+
+static void clearBit(uint64_t *set, uint32_t i) {
+    set[i / 64] &= ~(1ULL << (i % 64));
+}
+
+// What every block in a hole reads as
+static const uint8_t zeroBlock[BLOCK_SIZE];
+
+//Returns true if every byte of the block is zero.
+static bool isZeroBlock(const uint8_t *block) {
+    uint64_t acc = 0;
+    for (size_t k = 0; k < BLOCK_SIZE; k += 8) {
+        uint64_t w;
+        memcpy(&w, block + k, 8);
+        acc |= w;
+    }
+    return acc == 0;
 }
 
 /**
- * Checks the consistency of the inode bitmap against actual inode usage.
- */
-/**
- * Feature 3: Inode Bitmap Consistency Checker
- * Checks the consistency of the inode bitmap against actual inode usage.
+ * Streaming mode: the checker needs random access to the image (indirect blocks
+ * may point anywhere, and the later phases walk the trees again), but a pipe can
+ * only be read once, front to back. The stream is therefore consumed strictly
+ * sequentially in STREAM_CHUNK_BLOCKS pieces and spooled into an unlinked file in
+ * $TMPDIR (or /tmp); all-zero blocks are left as holes, so free space costs no
+ * disk. The checks then run on the spool as on any image file. Memory use is one
+ * chunk, independent of the image size. Returns the spool descriptor, or -1.
  */
-void checkInodeBitmap() {
-    int errorCount = 0;
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (inodeBitmap[i] && !inodeUsed[i]) {
-            errorCount++;
-            printf("ERROR: Inode %d marked used but not actually used.\n", i);
-        }
+static int spoolStream(int in, uint64_t *size) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/vsfsck-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
 
-        if (!inodeBitmap[i] && inodeUsed[i]) {
-            errorCount++;
-            printf("ERROR: Inode %d is used but not marked in bitmap.\n", i);
+    uint8_t *chunk = malloc((size_t)STREAM_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (!chunk) {
+        perror("Failed to allocate checker state");
+        exit(EXIT_FAILURE);
+    }
+    off_t offset = 0;
+    bool ok = true;
+    for (;;) {
+        size_t filled = 0;
+        while (filled < (size_t)STREAM_CHUNK_BLOCKS * BLOCK_SIZE) {
+            ssize_t n = read(in, chunk + filled, (size_t)STREAM_CHUNK_BLOCKS * BLOCK_SIZE - filled);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                ok = false;
+            }
+            if (n <= 0) {
+                break;
+            }
+            filled += n;
+        }
+        // Write each run of non-zero blocks with one call; a partial last block is kept as is
+        size_t k = 0;
+        while (ok && k < filled) {
+            size_t end = k;
+            while (end < filled && (filled - end < BLOCK_SIZE || !isZeroBlock(chunk + end))) {
+                end = filled - end < BLOCK_SIZE ? filled : end + BLOCK_SIZE;
+            }
+            if (end == k) {
+                k += BLOCK_SIZE;
+                continue;
+            }
+            if (pwrite(fd, chunk + k, end - k, offset + k) != (ssize_t)(end - k)) {
+                ok = false;
+            }
+            k = end;
+        }
+        offset += filled;
+        if (!ok || filled < (size_t)STREAM_CHUNK_BLOCKS * BLOCK_SIZE) {
+            break;
         }
     }
-    if (errorCount == 0) {
-        printf("Inode bitmap is consistent.\n");
+    free(chunk);
+    // Trailing holes only exist once the file is extended over them
+    if (!ok || ftruncate(fd, offset) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
     }
+    *size = offset;
+    return fd;
 }
 
-/**
- * Checks for duplicate data block references by multiple inodes.
- */
-/**
- * Feature 4: Duplicate Block Checker
- * Checks for duplicate data block references by multiple inodes.
- */
-void checkDuplicateBlocks() {
-    bool duplicateFound = false;
-    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-        if (blockRefCount[i] > 1) {
-            printf("ERROR: Data block %d is referenced by multiple inodes.\n", i);
-            duplicateFound = true;
+//Opens the image for block reads (and writes when writable is set), and maps it
+//read-only when useMmap is set. The path "-" streams the image from standard input.
+//direct opens the file with O_DIRECT where its filesystem supports it; it does not
+//apply to mapped images or to the spool of a stream.
+static bool openImage(Image *img, const char *path, bool useMmap, bool writable, bool direct) {
+    memset(img, 0, sizeof(*img));
+    if (strcmp(path, "-") == 0) {
+        img->fd = spoolStream(STDIN_FILENO, &img->size);
+    } else {
+        int flags = writable ? O_RDWR : O_RDONLY;
+        img->direct = direct && !useMmap;
+        img->fd = open(path, img->direct ? flags | O_DIRECT : flags);
+        if (img->fd < 0 && img->direct && errno == EINVAL) {
+            img->direct = false;
+            img->fd = open(path, flags);
         }
     }
-    if (!duplicateFound) {
-        printf("No duplicate data block references found.\n");
+    if (img->fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(img->fd, &st) == 0) {
+        img->size = st.st_size;
+        // A block device reports its size through an ioctl rather than st_size
+        uint64_t deviceSize;
+        if (S_ISBLK(st.st_mode) && ioctl(img->fd, BLKGETSIZE64, &deviceSize) == 0) {
+            img->size = deviceSize;
+        }
     }
+    if (!useMmap) {
+        return true;
+    }
+
+    if (img->size == 0) {
+        close(img->fd);
+        return false;
+    }
+    void *map = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+    if (map == MAP_FAILED) {
+        close(img->fd);
+        return false;
+    }
+    img->map = map;
+    img->mapSize = img->size;
+    return true;
 }
 
 /**
- * Checks for invalid block references in direct and indirect pointers of inodes.
+ * Sparse images: asks the filesystem for the holes of the image file with
+ * SEEK_DATA/SEEK_HOLE and marks the blocks that lie entirely in one, so they are
+ * treated as zeros without being read. A hole running to the end of the file
+ * takes the partial last block with it, whose tail reads as zeros anyway. Leaves
+ * holes NULL if the file has none or its filesystem cannot tell.
  */
-/**
- * Feature 5: Bad Block Checker
- * Checks for invalid block references in direct and indirect pointers of inodes.
- */
-void checkBadBlocks(FILE *fp) {
-    Inode inode;
-    uint8_t blockBuffer[BLOCK_SIZE];
-    bool badBlockFound = false;
-
-    for (int i = 0; i < MAX_INODES; i++) {
-        int blockNum = INODE_TABLE_START_BLOCK + (i * INODE_SIZE) / BLOCK_SIZE;
-        int offset = (i * INODE_SIZE) % BLOCK_SIZE;
+static void mapHoles(Image *img) {
+    uint64_t blocks = (img->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks > (uint64_t)UINT32_MAX + 1) {
+        blocks = (uint64_t)UINT32_MAX + 1;
+    }
+    uint64_t offset = 0;
+    while (offset < img->size) {
+        off_t data = lseek(img->fd, offset, SEEK_DATA);
+        if (data < 0 && errno != ENXIO) {
+            break;
+        }
+        uint64_t holeEnd = data < 0 ? img->size : (uint64_t)data;
+        uint64_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint64_t end = holeEnd >= img->size ? blocks : holeEnd / BLOCK_SIZE;
+        if (first < end && !img->holes) {
+            // Holes only spare reads, so without memory for the map they are read
+            img->holes = calloc(BITSET_WORDS(blocks), sizeof(uint64_t));
+            if (!img->holes) {
+                return;
+            }
+            img->holeBlocks = blocks;
+        }
+        for (uint64_t b = first; b < end; b++) {
+            if (b % 64 == 0 && end - b >= 64) {
+                img->holes[b / 64] = ~0ULL;
+                b += 63;
+            } else {
+                setBit(img->holes, (uint32_t)b);
+            }
+        }
+        off_t hole = data < 0 ? -1 : lseek(img->fd, data, SEEK_HOLE);
+        if (hole <= data) {
+            break;
+        }
+        offset = hole;
+    }
+}
 
-        readBlock(fp, blockNum, blockBuffer);
-        memcpy(&inode, blockBuffer + offset, sizeof(Inode));
+//Returns true if block blockNum lies entirely in a hole of the image file.
+static bool isHole(const Image *img, uint32_t blockNum) {
+    return img->holes && blockNum < img->holeBlocks && testBit(img->holes, blockNum);
+}
 
-        bool isValid = (inode.links > 0 && inode.dtime == 0);
-        if (!isValid) {
-            continue;
-        }
+static void closeImage(Image *img) {
+    if (img->map) {
+        munmap(img->map, img->mapSize);
+    }
+    free(img->holes);
+    close(img->fd);
+}
 
-        if (inode.direct >= MAX_DATA_BLOCKS) {
-            printf("ERROR: Inode %d has invalid direct block %u.\n", i, inode.direct);
-            badBlockFound = true;
-        }
+//Word-at-a-time 64-bit hash of one block, used to detect changed blocks.
+static uint64_t hashBlock(const uint8_t *block) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (size_t k = 0; k < BLOCK_SIZE; k += 8) {
+        uint64_t w;
+        memcpy(&w, block + k, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
 
-        if (inode.indirect >= MAX_DATA_BLOCKS && inode.indirect != 0) {
-            printf("ERROR: Inode %d has invalid single indirect block %u.\n", i, inode.indirect);
-            badBlockFound = true;
+static void recordSnapshotRead(VsfsckContext *ctx, uint32_t blockNum, const void *block) {
+    uint64_t hash = hashBlock(block);
+    pthread_mutex_lock(&ctx->snapshotLock);
+    if (ctx->snapshotCount == ctx->snapshotCapacity) {
+        SnapshotRead *reads = growArray(&ctx->reporter, ctx->snapshotReads, &ctx->snapshotCapacity,
+                                        sizeof(SnapshotRead), 1024);
+        if (!reads) {
+            pthread_mutex_unlock(&ctx->snapshotLock);
+            return;
         }
+        ctx->snapshotReads = reads;
+    }
+    ctx->snapshotReads[ctx->snapshotCount].block = blockNum;
+    ctx->snapshotReads[ctx->snapshotCount].hash = hash;
+    ctx->snapshotCount++;
+    pthread_mutex_unlock(&ctx->snapshotLock);
+}
 
-        if (inode.doubleIndirect >= MAX_DATA_BLOCKS && inode.doubleIndirect != 0) {
-            printf("ERROR: Inode %d has invalid double indirect block %u.\n", i, inode.doubleIndirect);
-            badBlockFound = true;
-        }
+static uint8_t *slotBuffer(VsfsckContext *ctx, int slot) {
+    return ctx->reader.buffers + (size_t)slot * BLOCK_SIZE;
+}
 
-        if (inode.tripleIndirect >= MAX_DATA_BLOCKS && inode.tripleIndirect != 0) {
-            printf("ERROR: Inode %d has invalid triple indirect block %u.\n", i, inode.tripleIndirect);
-            badBlockFound = true;
-        }
+//Returns the slot holding blockNum, or -1.
+static int findSlot(VsfsckContext *ctx, uint32_t blockNum) {
+    int slot = ctx->reader.buckets[blockNum & ctx->reader.bucketMask];
+    while (slot >= 0 && ctx->reader.slots[slot].block != blockNum) {
+        slot = ctx->reader.slots[slot].next;
     }
-    if (!badBlockFound) {
-        printf("No invalid block references found in inodes.\n");
+    return slot;
+}
+
+static void unlinkSlot(VsfsckContext *ctx, int slot) {
+    int *link = &ctx->reader.buckets[ctx->reader.slots[slot].block & ctx->reader.bucketMask];
+    while (*link != slot) {
+        link = &ctx->reader.slots[*link].next;
     }
+    *link = ctx->reader.slots[slot].next;
+    ctx->reader.slots[slot].state = SLOT_FREE;
 }
 
-/**
- * Main entry point of the program.
- * Validates command line arguments, opens the image file, and runs all checks.
- */
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <vsfs.img>\n", argv[0]);
-        return EXIT_FAILURE;
+//Moves completed io_uring reads into their slots.
+static void reapUring(VsfsckContext *ctx) {
+    unsigned head = *ctx->reader.cqHead;
+    unsigned tail = __atomic_load_n(ctx->reader.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ctx->reader.cqes[head & *ctx->reader.cqMask];
+        ReadSlot *slot = &ctx->reader.slots[cqe->user_data];
+        slot->result = cqe->res;
+        slot->state = SLOT_READY;
+        ctx->reader.inFlight--;
+        if (cqe->res > 0) {
+            countIo(&ctx->phaseStats[ctx->currentPhase].bytesRead, cqe->res);
+        }
     }
+    __atomic_store_n(ctx->reader.cqHead, head, __ATOMIC_RELEASE);
+}
 
-    FILE *fp = fopen(argv[1], "rb");
-    if (!fp) {
-        perror("Failed to open image file");
-        return EXIT_FAILURE;
+//Submits queued io_uring reads, waiting for at least one completion when wait is set.
+static void enterUring(VsfsckContext *ctx, bool wait) {
+    if (ctx->reader.unsubmitted == 0 && !wait) {
+        return;
+    }
+    int submitted = syscall(__NR_io_uring_enter, ctx->reader.ringFd, ctx->reader.unsubmitted, wait ? 1 : 0,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    countIo(&ctx->phaseStats[ctx->currentPhase].syscalls, 1);
+    if (submitted > 0) {
+        ctx->reader.unsubmitted -= submitted;
     }
+    reapUring(ctx);
+}
 
-    Superblock superblock;
-    readSuperblock(fp, &superblock);
-    printf("Superblock validation completed.\n");
+static void *readThreadMain(void *arg) {
+    VsfsckContext *ctx = arg;
+    pthread_mutex_lock(&ctx->reader.lock);
+    for (;;) {
+        while (!ctx->reader.stopping && ctx->reader.queueCount == 0) {
+            pthread_cond_wait(&ctx->reader.queued, &ctx->reader.lock);
+        }
+        if (ctx->reader.stopping) {
+            break;
+        }
+        int slot = ctx->reader.queue[ctx->reader.queueHead];
+        ctx->reader.queueHead = (ctx->reader.queueHead + 1) % ctx->reader.slotCount;
+        ctx->reader.queueCount--;
+        ctx->reader.slots[slot].state = SLOT_READING;
+        uint32_t blockNum = ctx->reader.slots[slot].block;
+        pthread_mutex_unlock(&ctx->reader.lock);
 
-    loadBitmap(fp, INODE_BITMAP_BLOCK_NO, inodeBitmap, MAX_INODES);
-    loadBitmap(fp, DATA_BITMAP_BLOCK_NO, dataBitmap, MAX_DATA_BLOCKS);
-    printf("Bitmaps loaded successfully.\n");
+        ssize_t got = pread(ctx->reader.fd, slotBuffer(ctx, slot), BLOCK_SIZE, (off_t)blockNum * BLOCK_SIZE);
+        countIo(&ctx->phaseStats[ctx->currentPhase].syscalls, 1);
+        if (got > 0) {
+            countIo(&ctx->phaseStats[ctx->currentPhase].bytesRead, got);
+        }
 
-    checkInodes(fp);
-    printf("Inode checks completed.\n");
+        pthread_mutex_lock(&ctx->reader.lock);
+        ctx->reader.slots[slot].result = got;
+        ctx->reader.slots[slot].state = SLOT_READY;
+        ctx->reader.inFlight--;
+        pthread_cond_broadcast(&ctx->reader.completed);
+    }
+    pthread_mutex_unlock(&ctx->reader.lock);
+    return NULL;
+}
 
-    checkInodeBitmap();
-    checkDataBitmap();
-    printf("Bitmap consistency checks completed.\n");
+//Sets up an io_uring instance with depth entries. Returns false if the kernel refuses.
+static bool setupUring(VsfsckContext *ctx, int depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ctx->reader.ringFd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ctx->reader.ringFd < 0) {
+        return false;
+    }
+    ctx->reader.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ctx->reader.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ctx->reader.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->reader.sqRing = mmap(NULL, ctx->reader.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ctx->reader.ringFd, IORING_OFF_SQ_RING);
+    ctx->reader.cqRing = mmap(NULL, ctx->reader.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ctx->reader.ringFd, IORING_OFF_CQ_RING);
+    ctx->reader.sqes = mmap(NULL, ctx->reader.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ctx->reader.ringFd, IORING_OFF_SQES);
+    if (ctx->reader.sqRing == MAP_FAILED || ctx->reader.cqRing == MAP_FAILED || ctx->reader.sqes == MAP_FAILED) {
+        close(ctx->reader.ringFd);
+        return false;
+    }
+    uint8_t *sq = ctx->reader.sqRing;
+    uint8_t *cq = ctx->reader.cqRing;
+    ctx->reader.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ctx->reader.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ctx->reader.sqArray = (unsigned *)(sq + params.sq_off.array);
+    ctx->reader.cqHead = (unsigned *)(cq + params.cq_off.head);
+    ctx->reader.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ctx->reader.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ctx->reader.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ctx->reader.unsubmitted = 0;
+    return true;
+}
 
-    checkDuplicateBlocks();
-    checkBadBlocks(fp);
-    printf("Block reference checks completed.\n");
+//Starts the asynchronous reader on img with depth reads in flight.
+static void startReader(VsfsckContext *ctx, Image *img, int depth, VsfsckIoEngine engine) {
+    ctx->reader.fd = img->fd;
+    ctx->reader.img = img;
+    ctx->reader.slotCount = 2 * depth;
+    ctx->reader.slots = xcalloc(ctx->reader.slotCount, sizeof(ReadSlot));
+    ctx->reader.buffers = xalignedAlloc(ctx->reader.slotCount, BLOCK_SIZE);
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)ctx->reader.slotCount) {
+        buckets <<= 1;
+    }
+    ctx->reader.bucketMask = buckets - 1;
+    ctx->reader.buckets = xcalloc(buckets, sizeof(int));
+    memset(ctx->reader.buckets, -1, buckets * sizeof(int));
+    ctx->reader.inFlight = 0;
+    ctx->reader.hand = 0;
 
-    fclose(fp);
-    return EXIT_SUCCESS;
+    ctx->reader.uring = engine != VSFSCK_IO_THREADS && setupUring(ctx, depth);
+    if (!ctx->reader.uring && engine == VSFSCK_IO_URING) {
+        reportDiagnostic(ctx, "io_uring is not available; using the thread pool reader.");
+    }
+    if (!ctx->reader.uring) {
+        pthread_cond_init(&ctx->reader.queued, NULL);
+        ctx->reader.queue = xcalloc(ctx->reader.slotCount, sizeof(int));
+        ctx->reader.queueHead = ctx->reader.queueCount = 0;
+        ctx->reader.stopping = false;
+        ctx->reader.threads = xcalloc(depth, sizeof(pthread_t));
+        for (ctx->reader.threadCount = 0; ctx->reader.threadCount < depth; ctx->reader.threadCount++) {
+            if (pthread_create(&ctx->reader.threads[ctx->reader.threadCount], NULL, readThreadMain, ctx) != 0) {
+                perror("Failed to start read thread");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    pthread_cond_init(&ctx->reader.completed, NULL);
+    ctx->reader.depth = depth;
 }
+
+//Waits for reads still in flight and releases the reader.
+static void stopReader(VsfsckContext *ctx) {
+    if (!ctx->reader.depth) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->reader.lock);
+    if (ctx->reader.uring) {
+        while (ctx->reader.inFlight > 0) {
+            enterUring(ctx, true);
+        }
+    } else {
+        ctx->reader.stopping = true;
+        pthread_cond_broadcast(&ctx->reader.queued);
+    }
+    pthread_mutex_unlock(&ctx->reader.lock);
+
+    if (ctx->reader.uring) {
+        munmap(ctx->reader.sqes, ctx->reader.sqesSize);
+        munmap(ctx->reader.cqRing, ctx->reader.cqRingSize);
+        munmap(ctx->reader.sqRing, ctx->reader.sqRingSize);
+        close(ctx->reader.ringFd);
+    } else {
+        for (int t = 0; t < ctx->reader.threadCount; t++) {
+            pthread_join(ctx->reader.threads[t], NULL);
+        }
+        pthread_cond_destroy(&ctx->reader.queued);
+        free(ctx->reader.threads);
+        free(ctx->reader.queue);
+    }
+    pthread_cond_destroy(&ctx->reader.completed);
+    free(ctx->reader.slots);
+    free(ctx->reader.buffers);
+    free(ctx->reader.buckets);
+    ctx->reader.depth = 0;
+}
+
+//Queues one read unless blockNum is already queued. Returns false when depth reads are in flight.
+static bool queueRead(VsfsckContext *ctx, uint32_t blockNum) {
+    if (isHole(ctx->reader.img, blockNum) || findSlot(ctx, blockNum) >= 0) {
+        return true;
+    }
+    if (ctx->reader.inFlight >= ctx->reader.depth) {
+        return false;
+    }
+    // Fewer than depth slots are busy, so a free or ready slot exists
+    int slot = ctx->reader.hand;
+    while (ctx->reader.slots[slot].state == SLOT_QUEUED || ctx->reader.slots[slot].state == SLOT_READING) {
+        slot = (slot + 1) % ctx->reader.slotCount;
+    }
+    ctx->reader.hand = (slot + 1) % ctx->reader.slotCount;
+    if (ctx->reader.slots[slot].state == SLOT_READY) {
+        unlinkSlot(ctx, slot);
+    }
+    ReadSlot *s = &ctx->reader.slots[slot];
+    s->block = blockNum;
+    s->state = SLOT_QUEUED;
+    s->next = ctx->reader.buckets[blockNum & ctx->reader.bucketMask];
+    ctx->reader.buckets[blockNum & ctx->reader.bucketMask] = slot;
+    ctx->reader.inFlight++;
+
+    if (ctx->reader.uring) {
+        unsigned tail = *ctx->reader.sqTail;
+        unsigned index = tail & *ctx->reader.sqMask;
+        struct io_uring_sqe *sqe = &ctx->reader.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = ctx->reader.fd;
+        sqe->addr = (uint64_t)(uintptr_t)slotBuffer(ctx, slot);
+        sqe->len = BLOCK_SIZE;
+        sqe->off = (uint64_t)blockNum * BLOCK_SIZE;
+        sqe->user_data = slot;
+        ctx->reader.sqArray[index] = index;
+        __atomic_store_n(ctx->reader.sqTail, tail + 1, __ATOMIC_RELEASE);
+        ctx->reader.unsubmitted++;
+    } else {
+        ctx->reader.queue[(ctx->reader.queueHead + ctx->reader.queueCount) % ctx->reader.slotCount] = slot;
+        ctx->reader.queueCount++;
+        pthread_cond_signal(&ctx->reader.queued);
+    }
+    return true;
+}
+
+/**
+ * Queues reads of blocks[from..count) in order until depth reads are in flight,
+ * and returns the index of the first block not queued. Does nothing unless the
+ * reader is running.
+ */
+static size_t queueReads(VsfsckContext *ctx, const uint32_t *blocks, size_t from, size_t count) {
+    if (!ctx->reader.depth) {
+        return count;
+    }
+    pthread_mutex_lock(&ctx->reader.lock);
+    if (ctx->reader.uring) {
+        reapUring(ctx);
+    }
+    while (from < count && queueRead(ctx, blocks[from])) {
+        from++;
+    }
+    if (ctx->reader.uring) {
+        enterUring(ctx, false);
+    }
+    pthread_mutex_unlock(&ctx->reader.lock);
+    return from;
+}
+
+//Copies a queued block into buffer, waiting for its read. Returns false if blockNum
+//was not queued, its slot was reused while waiting, or its read failed.
+static bool takeQueuedRead(VsfsckContext *ctx, uint32_t blockNum, void *buffer) {
+    pthread_mutex_lock(&ctx->reader.lock);
+    int slot;
+    while ((slot = findSlot(ctx, blockNum)) >= 0 && ctx->reader.slots[slot].state != SLOT_READY) {
+        if (ctx->reader.uring) {
+            enterUring(ctx, true);
+        } else {
+            pthread_cond_wait(&ctx->reader.completed, &ctx->reader.lock);
+        }
+    }
+    if (slot < 0) {
+        pthread_mutex_unlock(&ctx->reader.lock);
+        return false;
+    }
+    ssize_t got = ctx->reader.slots[slot].result;
+    if (got >= 0) {
+        memcpy(buffer, slotBuffer(ctx, slot), got);
+        memset((uint8_t *)buffer + got, 0, BLOCK_SIZE - got);
+    }
+    unlinkSlot(ctx, slot);
+    pthread_mutex_unlock(&ctx->reader.lock);
+    return got >= 0;
+}
+
+//Returns a pointer to block blockNum. Mapped images are viewed in place; otherwise
+//the block is read into buffer. Blocks past the end of the image read as zeros, and
+//blocks in holes are zeros without being read.
+static const void *viewBlock(VsfsckContext *ctx, Image *img, uint32_t blockNum, void *buffer) {
+    PhaseStats *st = &ctx->phaseStats[ctx->currentPhase];
+    size_t offset = (size_t)blockNum * BLOCK_SIZE;
+    countIo(&st->blockReads, 1);
+    if (isHole(img, blockNum)) {
+        countIo(&st->cacheHits, 1);
+        return zeroBlock;
+    }
+    if (!img->map) {
+        if (ctx->reader.depth && takeQueuedRead(ctx, blockNum, buffer)) {
+            countIo(&st->cacheHits, 1);
+        } else {
+            // Direct reads into an unaligned buffer bounce through an aligned one
+            uint8_t *target = img->direct && (uintptr_t)buffer % BLOCK_SIZE ? takeAlignedBlock(ctx) : buffer;
+            ssize_t got = pread(img->fd, target, BLOCK_SIZE, offset);
+            if (got < 0) {
+                got = 0;
+            }
+            countIo(&st->syscalls, 1);
+            countIo(&st->bytesRead, got);
+            if (target != buffer) {
+                memcpy(buffer, target, got);
+                returnAlignedBlock(ctx, target);
+            }
+            memset((uint8_t *)buffer + got, 0, BLOCK_SIZE - got);
+        }
+        if (ctx->snapshotting) {
+            recordSnapshotRead(ctx, blockNum, buffer);
+        }
+        return buffer;
+    }
+    countIo(&st->cacheHits, 1);
+    if (offset + BLOCK_SIZE <= img->mapSize) {
+        return img->map + offset;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    if (offset < img->mapSize) {
+        memcpy(buffer, img->map + offset, img->mapSize - offset);
+    }
+    return buffer;
+}
+
+//reads a block from the filesystem image into the provided buffer.
+static void readBlock(VsfsckContext *ctx, Image *img, uint32_t blockNum, void *buffer) {
+    const void *block = viewBlock(ctx, img, blockNum, buffer);
+    if (block != buffer) {
+        memcpy(buffer, block, BLOCK_SIZE);
+    }
+}
+
+//Hints the kernel about the access pattern of a range of blocks in a mapped image.
+static void adviseBlocks(VsfsckContext *ctx, Image *img, uint32_t firstBlock, uint32_t count, int advice) {
+    if (!img->map) {
+        return;
+    }
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)firstBlock * BLOCK_SIZE;
+    size_t end = start + (size_t)count * BLOCK_SIZE;
+    if (end > img->mapSize) {
+        end = img->mapSize;
+    }
+    start -= start % pageSize;
+    if (start < end) {
+        madvise(img->map + start, end - start, advice);
+        countIo(&ctx->phaseStats[ctx->currentPhase].syscalls, 1);
+    }
+}
+
+//Loads a bitmap starting at a specified block into a packed bitset, keeping the
+//on-disk bit order and clearing bits past count.
+static void loadBitmap(VsfsckContext *ctx, Image *img, uint32_t blockNum, uint64_t *bitmap, uint32_t count) {
+    uint8_t buffer[BLOCK_SIZE];
+    const uint8_t *rawBitmap = NULL;
+    size_t words = BITSET_WORDS(count);
+    for (size_t w = 0; w < words; w++) {
+        if (w % WORDS_PER_BLOCK == 0) {
+            rawBitmap = viewBlock(ctx, img, blockNum + w / WORDS_PER_BLOCK, buffer);
+        }
+        const uint8_t *bytes = rawBitmap + (w % WORDS_PER_BLOCK) * 8;
+        uint64_t word = 0;
+        for (int b = 0; b < 8; b++) {
+            word |= (uint64_t)bytes[b] << (8 * b);
+        }
+        bitmap[w] = word;
+    }
+    if (count % 64) {
+        bitmap[words - 1] &= (1ULL << (count % 64)) - 1;
+    }
+}
+
+//Direct mode: reads the inode table into the cache in runs of up to INODE_TABLE_RUN_BLOCKS
+//blocks, one call each, so bypassing the page cache costs few round trips. Runs stop
+//at holes, whose blocks are zeroed without a read.
+static void readInodeTableRuns(VsfsckContext *ctx, Image *img) {
+    PhaseStats *st = &ctx->phaseStats[ctx->currentPhase];
+    uint32_t b = 0;
+    while (b < ctx->geo.inodeTableBlocks) {
+        uint32_t blockNum = ctx->geo.inodeTableStart + b;
+        uint8_t *dest = ctx->inodeTableCache + (size_t)b * BLOCK_SIZE;
+        if (isHole(img, blockNum)) {
+            memset(dest, 0, BLOCK_SIZE);
+            countIo(&st->blockReads, 1);
+            countIo(&st->cacheHits, 1);
+            b++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (run < INODE_TABLE_RUN_BLOCKS && b + run < ctx->geo.inodeTableBlocks && !isHole(img, blockNum + run)) {
+            run++;
+        }
+        ssize_t got = pread(img->fd, dest, (size_t)run * BLOCK_SIZE, (off_t)blockNum * BLOCK_SIZE);
+        if (got < 0) {
+            got = 0;
+        }
+        memset(dest + got, 0, (size_t)run * BLOCK_SIZE - got);
+        countIo(&st->blockReads, run);
+        countIo(&st->syscalls, 1);
+        countIo(&st->bytesRead, got);
+        if (ctx->snapshotting) {
+            for (uint32_t k = 0; k < run; k++) {
+                recordSnapshotRead(ctx, blockNum + k, dest + (size_t)k * BLOCK_SIZE);
+            }
+        }
+        b += run;
+    }
+}
+
+//Reads every inode table block once into the inode table cache. A mapped image whose
+//inode table lies fully inside the file is used in place instead.
+static void loadInodeTable(VsfsckContext *ctx, Image *img) {
+    size_t tableEnd = ((size_t)ctx->geo.inodeTableStart + ctx->geo.inodeTableBlocks) * BLOCK_SIZE;
+    if (img->map && tableEnd <= img->mapSize) {
+        adviseBlocks(ctx, img, ctx->geo.inodeTableStart, ctx->geo.inodeTableBlocks, MADV_SEQUENTIAL);
+        adviseBlocks(ctx, img, ctx->geo.inodeTableStart, ctx->geo.inodeTableBlocks, MADV_WILLNEED);
+        ctx->inodeTable = img->map + (size_t)ctx->geo.inodeTableStart * BLOCK_SIZE;
+        return;
+    }
+    if (ctx->geo.inodeTableBlocks > ctx->inodeTableCacheBlocks) {
+        free(ctx->inodeTableCache);
+        ctx->inodeTableCacheBlocks = 0;
+        ctx->inodeTableCache = imageAlignedAlloc(&ctx->reporter, ctx->geo.inodeTableBlocks, BLOCK_SIZE);
+        if (!ctx->inodeTableCache) {
+            return;
+        }
+        ctx->inodeTableCacheBlocks = ctx->geo.inodeTableBlocks;
+    }
+    if (img->direct) {
+        readInodeTableRuns(ctx, img);
+        ctx->inodeTable = ctx->inodeTableCache;
+        return;
+    }
+    uint32_t queued = 0;
+    uint32_t *ahead = ctx->reader.depth ? xcalloc(ctx->reader.depth, sizeof(uint32_t)) : NULL;
+    for (uint32_t b = 0; b < ctx->geo.inodeTableBlocks; b++) {
+        // Top the reader's queue up in one batch whenever half of it has been consumed
+        if (ctx->reader.depth && queued < ctx->geo.inodeTableBlocks && queued <= b + ctx->reader.depth / 2) {
+            uint32_t count = 0;
+            for (; count < (uint32_t)ctx->reader.depth && queued + count < ctx->geo.inodeTableBlocks; count++) {
+                ahead[count] = ctx->geo.inodeTableStart + queued + count;
+            }
+            queued += queueReads(ctx, ahead, 0, count);
+        }
+        readBlock(ctx, img, ctx->geo.inodeTableStart + b, ctx->inodeTableCache + (size_t)b * BLOCK_SIZE);
+    }
+    free(ahead);
+    ctx->inodeTable = ctx->inodeTableCache;
+}
+
+//Returns inode i as a view into the inode table.
+static const Inode *getInode(VsfsckContext *ctx, uint32_t i) {
+    return (const Inode *)(ctx->inodeTable + (size_t)i * INODE_SIZE);
+}
+
+//Number of blocks needed to hold count bits.
+static uint32_t bitmapBlocks(uint32_t count) {
+    return (uint32_t)(((uint64_t)count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+}
+
+//Fills in the default 64-block layout.
+static void setDefaultGeometry(VsfsckContext *ctx) {
+    ctx->geo.totalBlocks = DEFAULT_TOTAL_BLOCKS;
+    ctx->geo.inodeBitmapBlock = DEFAULT_INODE_BITMAP_BLOCK;
+    ctx->geo.dataBitmapBlock = DEFAULT_DATA_BITMAP_BLOCK;
+    ctx->geo.inodeTableStart = DEFAULT_INODE_TABLE_START;
+    ctx->geo.dataBlockStart = DEFAULT_DATA_BLOCK_START;
+    ctx->geo.inodeCount = DEFAULT_INODE_COUNT;
+    ctx->geo.dataBlockCount = DEFAULT_TOTAL_BLOCKS - DEFAULT_DATA_BLOCK_START;
+    ctx->geo.inodeBitmapBlocks = bitmapBlocks(ctx->geo.inodeCount);
+    ctx->geo.dataBitmapBlocks = bitmapBlocks(ctx->geo.dataBlockCount);
+    ctx->geo.inodeTableBlocks = ctx->geo.inodeCount / INODES_PER_BLOCK;
+}
+
+//Returns true if the regions [aStart, aStart + aLen) and [bStart, bStart + bLen) overlap.
+static bool regionsOverlap(uint64_t aStart, uint64_t aLen, uint64_t bStart, uint64_t bLen) {
+    return aStart < bStart + bLen && bStart < aStart + aLen;
+}
+
+/**
+ * Derives the geometry from the superblock, with totalBlocks in place of the total
+ * block count it records. Returns false, leaving geo untouched, if the bitmaps,
+ * inode table and data region do not form a consistent layout.
+ */
+static bool deriveGeometry(VsfsckContext *ctx, const Superblock *superblock, uint32_t totalBlocks) {
+    Geometry g;
+    g.totalBlocks = totalBlocks;
+    g.inodeBitmapBlock = superblock->inodeBitmapBlock;
+    g.dataBitmapBlock = superblock->dataBitmapBlock;
+    g.inodeTableStart = superblock->inodeTableStart;
+    g.dataBlockStart = superblock->dataBlockStart;
+    g.inodeCount = superblock->inodeCount;
+
+    if (g.dataBlockStart <= g.inodeTableStart || g.dataBlockStart >= g.totalBlocks) {
+        return false;
+    }
+    g.dataBlockCount = g.totalBlocks - g.dataBlockStart;
+    g.inodeBitmapBlocks = bitmapBlocks(g.inodeCount);
+    g.dataBitmapBlocks = bitmapBlocks(g.dataBlockCount);
+    g.inodeTableBlocks = g.dataBlockStart - g.inodeTableStart;
+
+    if (g.inodeBitmapBlock == SUPERBLOCK_BLOCK_NO || g.dataBitmapBlock == SUPERBLOCK_BLOCK_NO ||
+        (uint64_t)g.inodeBitmapBlock + g.inodeBitmapBlocks > g.inodeTableStart ||
+        (uint64_t)g.dataBitmapBlock + g.dataBitmapBlocks > g.inodeTableStart ||
+        regionsOverlap(g.inodeBitmapBlock, g.inodeBitmapBlocks, g.dataBitmapBlock, g.dataBitmapBlocks)) {
+        return false;
+    }
+    ctx->geo = g;
+    return true;
+}
+
+//Sets up cleared usage tracking arrays for the current geometry, reusing the
+//previous image's allocation when it is large enough. Returns false if they do not fit.
+static bool allocTracking(VsfsckContext *ctx) {
+    size_t dataWords = BITSET_WORDS(ctx->geo.dataBlockCount);
+    size_t inodeWords = BITSET_WORDS(ctx->geo.inodeCount);
+    size_t words = 3 * dataWords + 2 * inodeWords;
+    if (words > ctx->trackingCapacity) {
+        free(ctx->trackingWords);
+        ctx->trackingCapacity = 0;
+        ctx->trackingWords = imageCalloc(&ctx->reporter, words, sizeof(uint64_t));
+        if (!ctx->trackingWords) {
+            return false;
+        }
+        ctx->trackingCapacity = words;
+    } else {
+        memset(ctx->trackingWords, 0, words * sizeof(uint64_t));
+    }
+    ctx->dataBitmap = ctx->trackingWords;
+    ctx->dataBlockUsed = ctx->dataBitmap + dataWords;
+    ctx->dataBlockShared = ctx->dataBlockUsed + dataWords;
+    ctx->inodeBitmap = ctx->dataBlockShared + dataWords;
+    ctx->inodeUsed = ctx->inodeBitmap + inodeWords;
+    return true;
+}
+
+static void freeTracking(VsfsckContext *ctx) {
+    free(ctx->trackingWords);
+    free(ctx->inodeTableCache);
+    ctx->trackingWords = NULL;
+    ctx->trackingCapacity = 0;
+    ctx->inodeTableCache = NULL;
+    ctx->inodeTableCacheBlocks = 0;
+    ctx->dataBitmap = ctx->dataBlockUsed = ctx->dataBlockShared = ctx->inodeBitmap = ctx->inodeUsed = NULL;
+}
+
+//Feature 1: Superblock Validates the superblock fields and prints errors if any are invalid.
+//Derives the geometry used by every later check, falling back to the default layout
+//when the superblock pointers are inconsistent. Returns the superblock, viewed in place
+//in mapped mode or read into buffer, which must hold a whole block.
+static const Superblock *readSuperblock(VsfsckContext *ctx, Image *img, void *buffer) {
+    const Superblock *superblock = viewBlock(ctx, img, SUPERBLOCK_BLOCK_NO, buffer);
+
+    if (superblock->magic != 0xD34D) {
+        reportFinding(&ctx->reporter, CHECK_SUPERBLOCK_MAGIC, -1, -1, "Invalid magic number in superblock.");
+    }
+    if (superblock->blockSize != BLOCK_SIZE) {
+        reportFinding(&ctx->reporter, CHECK_SUPERBLOCK_BLOCK_SIZE, -1, -1, "Invalid block size in superblock.");
+    }
+    // An invalid total is replaced by what the file holds, so that neither the tracking
+    // state nor the inode table, which ends inside the data region, outgrows the file
+    uint32_t totalBlocks = superblock->totalBlocks;
+    uint64_t fileBlocks = img->size / BLOCK_SIZE;
+    if (superblock->totalBlocks == 0 || (img->size && totalBlocks > fileBlocks)) {
+        reportFinding(&ctx->reporter, CHECK_SUPERBLOCK_TOTAL_BLOCKS, -1, -1, "Invalid total block count in superblock.");
+        if (img->size) {
+            totalBlocks = fileBlocks < UINT32_MAX ? (uint32_t)fileBlocks : UINT32_MAX;
+        }
+    }
+
+    if (!deriveGeometry(ctx, superblock, totalBlocks)) {
+        reportFinding(&ctx->reporter, CHECK_SUPERBLOCK_LAYOUT, -1, -1, "One or more superblock pointers are incorrect.");
+        setDefaultGeometry(ctx);
+    }
+
+    if (superblock->inodeSize != INODE_SIZE) {
+        reportFinding(&ctx->reporter, CHECK_SUPERBLOCK_INODE_SIZE, -1, -1, "Invalid inode size in superblock.");
+    }
+    // A table of 2^28 blocks or more holds more inodes than 32 bits count
+    uint64_t tableInodes = (uint64_t)ctx->geo.inodeTableBlocks * INODES_PER_BLOCK;
+    if (superblock->inodeCount > tableInodes) {
+        reportFinding(&ctx->reporter, CHECK_SUPERBLOCK_INODE_COUNT, -1, -1, "Inode count in superblock exceeds maximum allowed.");
+        ctx->geo.inodeCount = (uint32_t)tableInodes;
+    }
+    ctx->geo.inodeTableBlocks = (uint32_t)(((uint64_t)ctx->geo.inodeCount + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK);
+    return superblock;
+}
+
+static int compareBlockNums(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Asks the kernel to start reading a batch of absolute block numbers. The batch
+ * is sorted in place and contiguous runs are issued as one read-ahead each.
+ * Direct reads bypass the page cache the read-ahead would fill, so it is skipped.
+ */
+static void prefetchBlocks(VsfsckContext *ctx, Image *img, uint32_t *blocks, size_t count) {
+    if (count == 0 || img->direct) {
+        return;
+    }
+    qsort(blocks, count, sizeof(uint32_t), compareBlockNums);
+    size_t runStart = 0;
+    for (size_t k = 1; k <= count; k++) {
+        if (k < count && blocks[k] <= blocks[k - 1] + 1) {
+            continue;
+        }
+        uint32_t first = blocks[runStart];
+        uint32_t length = blocks[k - 1] - first + 1;
+        if (img->map) {
+            adviseBlocks(ctx, img, first, length, MADV_WILLNEED);
+        } else {
+            posix_fadvise(img->fd, (off_t)first * BLOCK_SIZE, (off_t)length * BLOCK_SIZE,
+                          POSIX_FADV_WILLNEED);
+            countIo(&ctx->phaseStats[ctx->currentPhase].syscalls, 1);
+        }
+        runStart = k;
+    }
+}
+
+//Appends the pointer in entry slot of parent (see BlockOwner) to block to map.
+static void appendOwner(Reporter *reporter, OwnerMap *map, uint32_t block, uint32_t inode, uint32_t parent, uint32_t slot) {
+    if (map->count == map->capacity) {
+        BlockOwner *owners = growArray(reporter, map->owners, &map->capacity, sizeof(BlockOwner), 256);
+        if (!owners) {
+            return;
+        }
+        map->owners = owners;
+    }
+    BlockOwner *owner = &map->owners[map->count++];
+    owner->block = block;
+    owner->inode = inode;
+    owner->parent = parent;
+    owner->slot = slot;
+}
+
+static void freeOwnerMap(OwnerMap *map) {
+    free(map->owners);
+    free(map->rangeFirsts);
+    free(map->used);
+    free(map->wanted);
+    memset(map, 0, sizeof(*map));
+}
+
+//Marks data block blockNum as referenced by inode i through entry slot of parent (see
+//BlockOwner), reporting it if the data bitmap disagrees. Returns true if the block was
+//already referenced, in which case the pointer is recorded as one of its owners.
+static bool markDataBlock(VsfsckContext *ctx, ScanState *state, uint32_t i, uint32_t blockNum, uint32_t parent, uint32_t slot) {
+    bool seen = testBit(state->used, blockNum);
+    if (seen) {
+        setBit(state->shared, blockNum);
+        appendOwner(state->reporter, state->owners, blockNum, i, parent, slot);
+    }
+    setBit(state->used, blockNum);
+    if (!testBit(ctx->dataBitmap, blockNum)) {
+        reportFinding(state->reporter, CHECK_BLOCK_NOT_IN_BITMAP, i, blockNum,
+                      "Inode %u references block %u not marked in data bitmap.", i, blockNum);
+    }
+    return seen;
+}
+
+//Appends a walk event for inode i to the scan's log, if the scan is being recorded.
+static void logWalk(ScanState *state, uint32_t kind, uint32_t i, uint32_t block, uint32_t extra) {
+    WalkLog *log = state->log;
+    if (!log) {
+        return;
+    }
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity;
+        WalkEvent *events = growArray(state->reporter, log->events, &capacity, sizeof(WalkEvent), 4096);
+        if (!events) {
+            return;
+        }
+        log->events = events;
+        log->capacity = capacity;
+    }
+    WalkEvent *event = &log->events[log->count++];
+    event->head = kind << 8 | (i % INODES_PER_BLOCK);
+    event->block = block;
+    event->extra = extra;
+}
+
+//Folds the hash of a descended indirect block into a tree checksum.
+static uint64_t foldTreeChecksum(uint64_t checksum, uint64_t blockHash) {
+    return (checksum ^ blockHash) * 0xff51afd7ed558ccdULL;
+}
+
+/**
+ * Returns true if inode table block tableBlock can be replayed from the previous
+ * run: its checksum is unchanged, every indirect block it walked (or skipped as
+ * already referenced) is still unreferenced (or referenced) by the inodes before it,
+ * and the walked indirect blocks still hash to the recorded tree checksum, so a
+ * fresh walk would take exactly the recorded steps. Unlike the walk, which learns
+ * each level from the one above, the check knows every indirect block up front and
+ * reads them in sorted runs.
+ */
+static bool canReplay(VsfsckContext *ctx, Image *img, const ScanState *state, uint32_t tableBlock, uint64_t checksum) {
+    const WalkLog *log = &ctx->previousLog;
+    if (tableBlock >= log->blocks || log->checksums[tableBlock] != checksum) {
+        return false;
+    }
+    uint64_t first = log->blockStart[tableBlock];
+    uint64_t end = log->blockStart[tableBlock + 1];
+    for (uint64_t e = first; e < end; e++) {
+        const WalkEvent *event = &log->events[e];
+        uint32_t kind = event->head >> 8;
+        if ((kind == WALK_DESCEND && testBit(state->used, event->block)) ||
+            (kind == WALK_SKIP && !testBit(state->used, event->block))) {
+            return false;
+        }
+    }
+
+    // Indirect blocks are read in chunks: prefetched (or queued) together, then hashed in walk order
+    uint64_t tree = 0;
+    uint64_t e = first;
+    while (e < end) {
+        uint32_t chunk[PTRS_PER_BLOCK];
+        uint32_t sorted[PTRS_PER_BLOCK];
+        size_t count = 0;
+        for (; e < end && count < PTRS_PER_BLOCK; e++) {
+            if (log->events[e].head >> 8 == WALK_DESCEND) {
+                chunk[count++] = ctx->geo.dataBlockStart + log->events[e].block;
+            }
+        }
+        size_t queued = 0;
+        if (ctx->reader.depth) {
+            queued = queueReads(ctx, chunk, 0, count);
+        } else {
+            memcpy(sorted, chunk, count * sizeof(uint32_t));
+            prefetchBlocks(ctx, img, sorted, count);
+        }
+        for (size_t k = 0; k < count; k++) {
+            uint32_t buffer[PTRS_PER_BLOCK];
+            tree = foldTreeChecksum(tree, hashBlock(viewBlock(ctx, img, chunk[k], buffer)));
+            if (queued < count) {
+                queued = queueReads(ctx, chunk, queued, count);
+            }
+        }
+    }
+    return tree == log->treeChecksums[tableBlock];
+}
+
+//Counts one walk event towards the current inode's tally and records it in the log.
+static void recordWalk(ScanState *state, uint32_t kind, uint32_t i, uint32_t block, uint32_t extra) {
+    FileTally *tally = &state->tally;
+    if (kind == WALK_BAD_ENTRY || kind == WALK_SKIP) {
+        tally->partial = true;
+    }
+    if (kind != WALK_BAD_ENTRY) {
+        tally->blocks++;
+    }
+    if (kind == WALK_LEAF && (uint64_t)extra + 1 > tally->endBlock) {
+        tally->endBlock = (uint64_t)extra + 1;
+    }
+    logWalk(state, kind, i, block, extra);
+}
+
+//Number of file blocks an indirect block of the given level maps; level 0 is a leaf.
+static uint64_t treeSpan(int level) {
+    uint64_t span = 1;
+    for (int l = 0; l < level; l++) {
+        span *= PTRS_PER_BLOCK;
+    }
+    return span;
+}
+
+/**
+ * Recovers the pointer behind each walk event of one inode. Events come in walk
+ * order, so the indirect blocks enclosing an event follow from the file blocks they
+ * map. Each inode starts with a zeroed cursor.
+ */
+typedef struct {
+    // Descended indirect blocks enclosing the current event, outermost first
+    uint32_t parents[3];
+    int levels[3];
+    uint64_t starts[3];
+    int depth;
+} WalkCursor;
+
+//Sets *parent and *slot (see BlockOwner) to the pointer behind event, which must not
+//be a bad entry, and moves cursor past it.
+static void followWalkEvent(WalkCursor *cursor, const WalkEvent *event, uint32_t *parent, uint32_t *slot) {
+    uint64_t fileBlock = event->extra;
+    while (cursor->depth > 0 &&
+           fileBlock >= cursor->starts[cursor->depth - 1] + treeSpan(cursor->levels[cursor->depth - 1])) {
+        cursor->depth--;
+    }
+    int level;
+    if (cursor->depth == 0) {
+        // A root: trees start at file block 1, 1 + 1024 and 1 + 1024 + 1024^2
+        level = fileBlock == 1 ? 1 : fileBlock == 1 + PTRS_PER_BLOCK ? 2 : 3;
+        *parent = NO_OWNER_PARENT;
+        *slot = (uint32_t)level;
+    } else {
+        level = cursor->levels[cursor->depth - 1] - 1;
+        *parent = cursor->parents[cursor->depth - 1];
+        *slot = (uint32_t)((fileBlock - cursor->starts[cursor->depth - 1]) / treeSpan(level));
+    }
+    if (event->head >> 8 == WALK_DESCEND) {
+        cursor->parents[cursor->depth] = event->block;
+        cursor->levels[cursor->depth] = level;
+        cursor->starts[cursor->depth] = fileBlock;
+        cursor->depth++;
+    }
+}
+
+//Applies the recorded walk events of inode i, advancing *next past them.
+static void replayWalk(VsfsckContext *ctx, ScanState *state, uint32_t i, uint64_t *next, uint64_t end) {
+    WalkCursor cursor = { .depth = 0 };
+    while (*next < end && (ctx->previousLog.events[*next].head & 0xff) == i % INODES_PER_BLOCK) {
+        const WalkEvent *event = &ctx->previousLog.events[(*next)++];
+        uint32_t kind = event->head >> 8;
+        if (kind == WALK_BAD_ENTRY) {
+            reportFinding(state->reporter, CHECK_INDIRECT_BAD_ENTRY, i, event->block,
+                          "Inode %u has invalid block %u in indirect block %u.", i, event->block, event->extra);
+        } else {
+            uint32_t parent;
+            uint32_t slot;
+            followWalkEvent(&cursor, event, &parent, &slot);
+            markDataBlock(ctx, state, i, event->block, parent, slot);
+        }
+        recordWalk(state, kind, i, event->block, event->extra);
+    }
+}
+
+/**
+ * Marks an indirect block of the given level (1 = single, 2 = double, 3 = triple)
+ * and every block reachable from it as used by inode i. Zero entries are holes.
+ * An indirect block that is already referenced is reported as shared but not
+ * walked again, so corrupt trees cannot multiply the work. fileBlock is the index
+ * within the file of the first block the tree maps, and parent and slot give the
+ * pointer to blockNum as in BlockOwner.
+ */
+static void walkIndirect(VsfsckContext *ctx, Image *img, ScanState *state, uint32_t i, uint32_t blockNum, int level,
+                  uint64_t fileBlock, uint32_t parent, uint32_t slot) {
+    bool seen = markDataBlock(ctx, state, i, blockNum, parent, slot);
+    recordWalk(state, seen ? WALK_SKIP : WALK_DESCEND, i, blockNum, (uint32_t)fileBlock);
+    if (seen) {
+        return;
+    }
+    if (state->descended) {
+        setBit(state->descended, blockNum);
+    }
+
+    uint32_t buffer[PTRS_PER_BLOCK];
+    const uint32_t *ptrs = viewBlock(ctx, img, ctx->geo.dataBlockStart + blockNum, buffer);
+    uint64_t childSpan = treeSpan(level - 1);
+    if (state->log) {
+        uint64_t *tree = &state->log->treeChecksums[i / INODES_PER_BLOCK];
+        *tree = foldTreeChecksum(*tree, hashBlock((const uint8_t *)ptrs));
+    }
+
+    // Children are queued with the asynchronous reader in walk order, topping the
+    // queue up after each child; without it they are prefetched as sorted runs.
+    uint32_t children[PTRS_PER_BLOCK];
+    size_t childCount = 0;
+    size_t queued = 0;
+    if (level > 1) {
+        for (size_t k = 0; k < PTRS_PER_BLOCK; k++) {
+            if (ptrs[k] != 0 && ptrs[k] < ctx->geo.dataBlockCount && !testBit(state->used, ptrs[k])) {
+                children[childCount++] = ctx->geo.dataBlockStart + ptrs[k];
+            }
+        }
+        if (ctx->reader.depth) {
+            queued = queueReads(ctx, children, 0, childCount);
+        } else {
+            prefetchBlocks(ctx, img, children, childCount);
+        }
+    }
+
+    for (size_t k = 0; k < PTRS_PER_BLOCK; k++) {
+        uint32_t ptr = ptrs[k];
+        if (ptr == 0) {
+            continue;
+        }
+        if (ptr >= ctx->geo.dataBlockCount) {
+            reportFinding(state->reporter, CHECK_INDIRECT_BAD_ENTRY, i, ptr,
+                          "Inode %u has invalid block %u in indirect block %u.", i, ptr, blockNum);
+            recordWalk(state, WALK_BAD_ENTRY, i, ptr, blockNum);
+            continue;
+        }
+        if (level == 1) {
+            markDataBlock(ctx, state, i, ptr, blockNum, (uint32_t)k);
+            recordWalk(state, WALK_LEAF, i, ptr, (uint32_t)(fileBlock + k));
+        } else {
+            walkIndirect(ctx, img, state, i, ptr, level - 1, fileBlock + k * childSpan, blockNum, (uint32_t)k);
+            if (queued < childCount) {
+                queued = queueReads(ctx, children, queued, childCount);
+            }
+        }
+    }
+}
+
+//Starts read-ahead of the indirect roots of the valid inodes in [first, end).
+static void prefetchIndirectRoots(VsfsckContext *ctx, Image *img, uint32_t first, uint32_t end) {
+    uint32_t roots[INODES_PER_BLOCK * 3];
+    size_t count = 0;
+    for (uint32_t i = first; i < end; i++) {
+        const Inode *inode = getInode(ctx, i);
+        if (inode->links == 0 || inode->dtime != 0) {
+            continue;
+        }
+        uint32_t ptrs[3] = { inode->indirect, inode->doubleIndirect, inode->tripleIndirect };
+        for (int k = 0; k < 3; k++) {
+            if (ptrs[k] != 0 && ptrs[k] < ctx->geo.dataBlockCount) {
+                roots[count++] = ctx->geo.dataBlockStart + ptrs[k];
+            }
+        }
+    }
+    if (ctx->reader.depth) {
+        queueReads(ctx, roots, 0, count);
+    } else {
+        prefetchBlocks(ctx, img, roots, count);
+    }
+}
+
+/**
+ * Checks an inode's blocks and size fields against its walked tree. blocks counts
+ * every block the inode references, pointer blocks included. The direct block is
+ * always allocated, so only blocks mapped through indirect trees must lie within
+ * the size rounded up to whole blocks. The 32-bit size saturates: UINT32_MAX stands
+ * for any file that extends past 4 GiB.
+ */
+static void visitFileTally(VsfsckContext *ctx, ScanState *state, uint32_t i, const Inode *inode, bool isValid) {
+    (void)ctx;
+    const FileTally *tally = &state->tally;
+    if (!isValid || tally->partial) {
+        return;
+    }
+    if (inode->blocks != tally->blocks) {
+        reportFinding(state->reporter, CHECK_INODE_BLOCK_COUNT, i, -1,
+                      "Inode %u has blocks %u but references %u blocks.", i, inode->blocks, tally->blocks);
+    }
+    uint64_t sizeBlocks = ((uint64_t)inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (tally->endBlock > sizeBlocks && inode->size != UINT32_MAX) {
+        reportFinding(state->reporter, CHECK_INODE_SIZE, i, -1,
+                      "Inode %u has size %u but maps file block %llu past its end.", i, inode->size,
+                      (unsigned long long)(tally->endBlock - 1));
+    }
+}
+
+static const CheckVisitors fileTallyCheck = { visitFileTally, NULL, NULL, NULL, NULL };
+
+/**
+ * Checks inodes [first, end) for validity and consistency with inode bitmap.
+ * Records used inodes in the inodeUsed bitset and data block usage in
+ * state, following the single, double and triple indirect trees of every valid inode.
+ */
+static void checkInodeRange(VsfsckContext *ctx, Image *img, ScanState *state, uint32_t first, uint32_t end) {
+    // Replay cursor into previousLog for the current inode table block, when replaying
+    bool replaying = false;
+    uint64_t next = 0;
+    uint64_t replayEnd = 0;
+
+    for (uint32_t i = first; i < end && !reporterFull(state->reporter); i++) {
+        const Inode *inode = getInode(ctx, i);
+
+        if (i % INODES_PER_BLOCK == 0) {
+            uint32_t tableBlock = i / INODES_PER_BLOCK;
+            replaying = false;
+            if (state->log) {
+                uint64_t checksum = hashBlock(ctx->inodeTable + (size_t)tableBlock * BLOCK_SIZE);
+                state->log->blockStart[tableBlock] = state->log->count;
+                state->log->checksums[tableBlock] = checksum;
+                state->log->treeChecksums[tableBlock] = 0;
+                if (canReplay(ctx, img, state, tableBlock, checksum)) {
+                    replaying = true;
+                    state->log->treeChecksums[tableBlock] = ctx->previousLog.treeChecksums[tableBlock];
+                    next = ctx->previousLog.blockStart[tableBlock];
+                    replayEnd = ctx->previousLog.blockStart[tableBlock + 1];
+                    ctx->replayedBlocks++;
+                }
+            }
+            if (!replaying) {
+                uint32_t blockEnd = i + INODES_PER_BLOCK < end ? i + INODES_PER_BLOCK : end;
+                prefetchIndirectRoots(ctx, img, i, blockEnd);
+            }
+        }
+
+        bool isValid = (inode->links > 0 && inode->dtime == 0);
+        if (isValid) {
+            setBit(ctx->inodeUsed, i);
+            FileTally *tally = &state->tally;
+            memset(tally, 0, sizeof(*tally));
+
+            // Out-of-range direct blocks and roots are reported by the bad block check
+            if (inode->direct >= ctx->geo.dataBlockCount) {
+                tally->partial = true;
+            } else {
+                markDataBlock(ctx, state, i, inode->direct, NO_OWNER_PARENT, 0);
+                tally->blocks++;
+            }
+
+            // Follow indirect trees. Out-of-range roots leave no walk events, so a
+            // replayed inode checks them here
+            uint32_t roots[3] = { inode->indirect, inode->doubleIndirect, inode->tripleIndirect };
+            if (replaying) {
+                replayWalk(ctx, state, i, &next, replayEnd);
+                for (int level = 1; level <= 3; level++) {
+                    if (roots[level - 1] >= ctx->geo.dataBlockCount) {
+                        tally->partial = true;
+                    }
+                }
+            } else {
+                uint64_t fileBlock = 1;
+                uint64_t span = 1;
+                for (int level = 1; level <= 3; level++) {
+                    uint32_t root = roots[level - 1];
+                    span *= PTRS_PER_BLOCK;
+                    if (root >= ctx->geo.dataBlockCount) {
+                        tally->partial = true;
+                    } else if (root != 0) {
+                        walkIndirect(ctx, img, state, i, root, level, fileBlock, NO_OWNER_PARENT, (uint32_t)level);
+                    }
+                    fileBlock += span;
+                }
+            }
+        }
+        for (int c = 0; c < ctx->checkRegistryCount; c++) {
+            if (ctx->checkRegistry[c]->visitInode) {
+                ctx->checkRegistry[c]->visitInode(ctx, state, i, inode, isValid);
+            }
+        }
+    }
+}
+
+static void freeWalkLog(WalkLog *log) {
+    free(log->events);
+    free(log->blockStart);
+    free(log->checksums);
+    free(log->treeChecksums);
+    memset(log, 0, sizeof(*log));
+}
+
+//Reads count items of size bytes into a new allocation, or returns NULL on a short
+//read. count comes from the file, so an allocation that fails is a NULL too.
+static void *readArray(FILE *fp, uint64_t count, size_t size) {
+    void *p = count <= SIZE_MAX / size ? calloc(count ? count : 1, size) : NULL;
+    if (!p || fread(p, size, count, fp) != count) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * Loads the walk log of a previous run into previousLog. A missing, corrupt or
+ * stale file (different geometry) leaves previousLog empty, so every inode table
+ * block is scanned in full.
+ */
+static void loadState(VsfsckContext *ctx, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return;
+    }
+    StateHeader header;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == STATE_MAGIC &&
+        header.totalBlocks == ctx->geo.totalBlocks && header.inodeBitmapBlock == ctx->geo.inodeBitmapBlock &&
+        header.dataBitmapBlock == ctx->geo.dataBitmapBlock && header.inodeTableStart == ctx->geo.inodeTableStart &&
+        header.dataBlockStart == ctx->geo.dataBlockStart && header.inodeCount == ctx->geo.inodeCount &&
+        header.blocks == ctx->geo.inodeTableBlocks) {
+        ctx->previousLog.blocks = header.blocks;
+        ctx->previousLog.count = header.eventCount;
+        ctx->previousLog.checksums = readArray(fp, header.blocks, sizeof(uint64_t));
+        ctx->previousLog.treeChecksums = readArray(fp, header.blocks, sizeof(uint64_t));
+        ctx->previousLog.blockStart = readArray(fp, (uint64_t)header.blocks + 1, sizeof(uint64_t));
+        ctx->previousLog.events = readArray(fp, header.eventCount, sizeof(WalkEvent));
+        bool valid = ctx->previousLog.checksums && ctx->previousLog.treeChecksums && ctx->previousLog.blockStart &&
+                     ctx->previousLog.events;
+        for (uint32_t b = 0; valid && b < header.blocks; b++) {
+            valid = ctx->previousLog.blockStart[b] <= ctx->previousLog.blockStart[b + 1] &&
+                    ctx->previousLog.blockStart[b + 1] <= header.eventCount;
+        }
+        if (!valid) {
+            freeWalkLog(&ctx->previousLog);
+        }
+    }
+    fclose(fp);
+}
+
+//Writes currentLog as the new state file, replacing the old one atomically.
+static void saveState(VsfsckContext *ctx, const char *path) {
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        reportDiagnostic(ctx, "Failed to write checker state: %s", strerror(errno));
+        return;
+    }
+    StateHeader header = { STATE_MAGIC, ctx->geo.totalBlocks, ctx->geo.inodeBitmapBlock, ctx->geo.dataBitmapBlock,
+                           ctx->geo.inodeTableStart, ctx->geo.dataBlockStart, ctx->geo.inodeCount, ctx->currentLog.blocks,
+                           0, ctx->currentLog.count };
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(ctx->currentLog.checksums, sizeof(uint64_t), ctx->currentLog.blocks, fp) == ctx->currentLog.blocks &&
+              fwrite(ctx->currentLog.treeChecksums, sizeof(uint64_t), ctx->currentLog.blocks, fp) == ctx->currentLog.blocks &&
+              fwrite(ctx->currentLog.blockStart, sizeof(uint64_t), (size_t)ctx->currentLog.blocks + 1, fp) == (size_t)ctx->currentLog.blocks + 1 &&
+              fwrite(ctx->currentLog.events, sizeof(WalkEvent), ctx->currentLog.count, fp) == ctx->currentLog.count;
+    if (fclose(fp) != 0 || !ok || rename(tmpPath, path) != 0) {
+        reportDiagnostic(ctx, "Failed to write checker state: %s", strerror(errno));
+        remove(tmpPath);
+    }
+}
+
+/**
+ * One worker of the parallel inode scan. Findings are buffered by a private
+ * reporter so they can be emitted in inode order after the join.
+ */
+typedef struct {
+    VsfsckContext *ctx;
+    Image *img;
+    ScanState state;
+    Reporter reporter;
+    OwnerMap owners;
+    uint32_t first;
+    uint32_t end;
+} ScanWorker;
+
+static void *scanWorkerMain(void *arg) {
+    ScanWorker *worker = arg;
+    checkInodeRange(worker->ctx, worker->img, &worker->state, worker->first, worker->end);
+    return NULL;
+}
+
+/**
+ * Folds a worker's shards into the context's usage in inode order. If the worker
+ * walked an indirect block that an earlier range already referenced, the serial
+ * scan would not have walked it, so the range is re-scanned serially against the
+ * merged state instead. The same happens when the worker's findings would overrun
+ * the error limit, so the scan stops at the same finding. Either way the output
+ * matches the serial scan exactly. Blocks that an earlier range already referenced
+ * are noted as RangeFirsts, since the worker did not record its first pointer to them.
+ */
+static void mergeScanWorker(VsfsckContext *ctx, Image *img, ScanWorker *worker) {
+    ctx->reporter.outOfMemory |= worker->reporter.outOfMemory;
+    if (reporterFull(&ctx->reporter)) {
+        return;
+    }
+    size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+    bool conflict = reporterFull(&worker->reporter) ||
+                    (ctx->reporter.limit && ctx->reporter.total + worker->reporter.total > ctx->reporter.limit);
+    for (size_t w = 0; w < words && !conflict; w++) {
+        conflict = (worker->state.descended[w] & ctx->dataBlockUsed[w]) != 0;
+    }
+
+    if (conflict) {
+        clearEvents(&worker->reporter);
+        ScanState serial = { ctx->dataBlockUsed, ctx->dataBlockShared, NULL, &ctx->reporter, NULL,
+                             &ctx->duplicateOwners, { 0, 0, false } };
+        checkInodeRange(ctx, img, &serial, worker->first, worker->end);
+        return;
+    }
+
+    OwnerMap *owners = &ctx->duplicateOwners;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t earlier = worker->state.used[w] & ctx->dataBlockUsed[w];
+        ctx->dataBlockShared[w] |= worker->state.shared[w] | earlier;
+        ctx->dataBlockUsed[w] |= worker->state.used[w];
+        for (; earlier; earlier &= earlier - 1) {
+            if (owners->rangeFirstCount == owners->rangeFirstCapacity) {
+                RangeFirst *firsts = growArray(&ctx->reporter, owners->rangeFirsts, &owners->rangeFirstCapacity,
+                                               sizeof(RangeFirst), 256);
+                if (!firsts) {
+                    break;
+                }
+                owners->rangeFirsts = firsts;
+            }
+            RangeFirst *first = &owners->rangeFirsts[owners->rangeFirstCount++];
+            first->inode = worker->first;
+            first->block = (uint32_t)(w * 64 + __builtin_ctzll(earlier));
+        }
+    }
+    for (size_t k = 0; k < worker->owners.count; k++) {
+        const BlockOwner *owner = &worker->owners.owners[k];
+        appendOwner(&ctx->reporter, owners, owner->block, owner->inode, owner->parent, owner->slot);
+    }
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        ctx->reporter.counts[c] += worker->reporter.counts[c];
+    }
+    ctx->reporter.total += worker->reporter.total;
+    moveEvents(&worker->reporter, &ctx->reporter);
+}
+
+/**
+ * Checks all inodes, splitting the inode table across jobs threads. Ranges are
+ * multiples of 64 inodes so workers never share an inodeUsed word.
+ */
+static void checkInodes(VsfsckContext *ctx, Image *img, int jobs, bool incremental) {
+    uint32_t perJob = jobs > 1 ? (uint32_t)((((uint64_t)ctx->geo.inodeCount + jobs - 1) / jobs + 63) / 64 * 64) : 0;
+    if (incremental || jobs <= 1 || perJob >= ctx->geo.inodeCount) {
+        ScanState serial = { ctx->dataBlockUsed, ctx->dataBlockShared, NULL, &ctx->reporter, NULL,
+                             &ctx->duplicateOwners, { 0, 0, false } };
+        if (incremental) {
+            ctx->currentLog.blocks = ctx->geo.inodeTableBlocks;
+            ctx->currentLog.blockStart = imageCalloc(&ctx->reporter, (size_t)ctx->geo.inodeTableBlocks + 1, sizeof(uint64_t));
+            ctx->currentLog.checksums = imageCalloc(&ctx->reporter, ctx->geo.inodeTableBlocks, sizeof(uint64_t));
+            ctx->currentLog.treeChecksums = imageCalloc(&ctx->reporter, ctx->geo.inodeTableBlocks, sizeof(uint64_t));
+            if (!ctx->currentLog.blockStart || !ctx->currentLog.checksums || !ctx->currentLog.treeChecksums) {
+                return;
+            }
+            serial.log = &ctx->currentLog;
+        }
+        checkInodeRange(ctx, img, &serial, 0, ctx->geo.inodeCount);
+        if (incremental) {
+            ctx->currentLog.blockStart[ctx->currentLog.blocks] = ctx->currentLog.count;
+        }
+        return;
+    }
+
+    size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+    ScanWorker *workers = xcalloc(jobs, sizeof(ScanWorker));
+    pthread_t *threads = xcalloc(jobs, sizeof(pthread_t));
+    int count = 0;
+    // Each worker's three shards are slices of one allocation. Without memory for
+    // all of them the scan runs serially instead
+    bool shards = true;
+    for (uint32_t first = 0; first < ctx->geo.inodeCount; first += perJob) {
+        ScanWorker *worker = &workers[count++];
+        worker->ctx = ctx;
+        worker->img = img;
+        worker->first = first;
+        worker->end = ctx->geo.inodeCount - first > perJob ? first + perJob : ctx->geo.inodeCount;
+        worker->state.used = calloc(3 * words + 1, sizeof(uint64_t));
+        if (!worker->state.used) {
+            shards = false;
+            continue;
+        }
+        worker->state.shared = worker->state.used + words;
+        worker->state.descended = worker->state.shared + words;
+        worker->state.reporter = &worker->reporter;
+        worker->state.owners = &worker->owners;
+        worker->reporter.limit = ctx->reporter.limit;
+    }
+    int started = 0;
+    for (; shards && started < count; started++) {
+        if (pthread_create(&threads[started], NULL, scanWorkerMain, &workers[started]) != 0) {
+            perror("Failed to start scan thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (int t = 0; t < count; t++) {
+        if (shards) {
+            mergeScanWorker(ctx, img, &workers[t]);
+        }
+        free(workers[t].state.used);
+        freeOwnerMap(&workers[t].owners);
+        clearEvents(&workers[t].reporter);
+        free(workers[t].reporter.events);
+    }
+    free(workers);
+    free(threads);
+    if (!shards) {
+        checkInodes(ctx, img, 1, false);
+    }
+}
+
+/**
+ * Range mode. Instead of one finding per bit, the bitmap checks make a pass over
+ * the packed bitsets once the scans are done and report every run of consecutive
+ * blocks or inodes with the same finding as one, e.g. "Data blocks 1200-98000
+ * (96801) marked used in bitmap but not referenced.". Runs are found a word at a
+ * time, so a badly corrupted image costs one finding per run rather than per bit;
+ * the per-check counts still count every block or inode. A run of one keeps the
+ * message of a single finding.
+ */
+typedef uint64_t (*BitsetMask)(const VsfsckContext *ctx, size_t w);
+
+//Returns the first bit at or after from whose value in mask is value, or count if
+//there is none below count.
+static uint32_t nextMaskBit(const VsfsckContext *ctx, BitsetMask mask, bool value, uint32_t from, uint32_t count) {
+    if (from >= count) {
+        return count;
+    }
+    size_t words = BITSET_WORDS(count);
+    size_t w = from / 64;
+    uint64_t word = (value ? mask(ctx, w) : ~mask(ctx, w)) & (~0ULL << (from % 64));
+    while (!word && ++w < words) {
+        word = value ? mask(ctx, w) : ~mask(ctx, w);
+    }
+    if (!word) {
+        return count;
+    }
+    uint64_t bit = w * 64 + __builtin_ctzll(word);
+    return bit < count ? (uint32_t)bit : count;
+}
+
+/**
+ * Reports, in order, every run of consecutive bits below count that mismatch
+ * selects. Each of those bits is selected by exactly one of first and second; a
+ * run ends where the mask that selected its first bit stops selecting.
+ */
+static void reportMaskRuns(VsfsckContext *ctx, BitsetMask mismatch, BitsetMask first, BitsetMask second, uint32_t count,
+                    void (*report)(VsfsckContext *ctx, bool inFirst, uint32_t start, uint32_t length)) {
+    uint32_t start = nextMaskBit(ctx, mismatch, true, 0, count);
+    while (start < count && !reporterFull(&ctx->reporter)) {
+        bool inFirst = first(ctx, start / 64) >> (start % 64) & 1;
+        uint32_t end = nextMaskBit(ctx, inFirst ? first : second, false, start, count);
+        report(ctx, inFirst, start, end - start);
+        start = nextMaskBit(ctx, mismatch, true, end, count);
+    }
+}
+
+/**
+ * Feature 2: Data Bitmap Consistency Checker
+ * Visits the data blocks whose bitmap bit disagrees with whether any inode
+ * references them.
+ */
+static uint64_t dataBitmapMask(const VsfsckContext *ctx, size_t w) {
+    return ctx->dataBitmap[w] ^ ctx->dataBlockUsed[w];
+}
+
+static uint64_t dataBitmapUnusedMask(const VsfsckContext *ctx, size_t w) {
+    return ctx->dataBitmap[w] & ~ctx->dataBlockUsed[w];
+}
+
+static uint64_t dataBitmapUnmarkedMask(const VsfsckContext *ctx, size_t w) {
+    return ~ctx->dataBitmap[w] & ctx->dataBlockUsed[w];
+}
+
+//Selects no blocks in range mode, where finishDataBitmap() reports runs instead.
+static uint64_t dataBitmapBlockMask(const VsfsckContext *ctx, size_t w) {
+    return ctx->reportRanges ? 0 : dataBitmapMask(ctx, w);
+}
+
+static void visitDataBitmap(VsfsckContext *ctx, uint32_t block) {
+    if (testBit(ctx->dataBitmap, block)) {
+        reportFinding(&ctx->reporter, CHECK_DATA_BITMAP_UNUSED, -1, block,
+                      "Data block %u marked used in bitmap but not referenced.", block);
+    } else {
+        reportFinding(&ctx->reporter, CHECK_DATA_BITMAP_UNMARKED, -1, block,
+                      "Data block %u is used but not marked in bitmap.", block);
+    }
+}
+
+static void reportDataBitmapRun(VsfsckContext *ctx, bool unused, uint32_t start, uint32_t length) {
+    length = clipRange(&ctx->reporter, length);
+    if (length == 0) {
+        return;
+    }
+    if (length == 1) {
+        visitDataBitmap(ctx, start);
+    } else if (unused) {
+        reportRange(&ctx->reporter, CHECK_DATA_BITMAP_UNUSED, length, -1, start,
+                    "Data blocks %u-%u (%u) marked used in bitmap but not referenced.", start, start + length - 1, length);
+    } else {
+        reportRange(&ctx->reporter, CHECK_DATA_BITMAP_UNMARKED, length, -1, start,
+                    "Data blocks %u-%u (%u) are used but not marked in bitmap.", start, start + length - 1, length);
+    }
+}
+
+static void finishDataBitmap(VsfsckContext *ctx) {
+    if (ctx->reportRanges) {
+        reportMaskRuns(ctx, dataBitmapMask, dataBitmapUnusedMask, dataBitmapUnmarkedMask, ctx->geo.dataBlockCount,
+                       reportDataBitmapRun);
+    }
+}
+
+static const CheckVisitors dataBitmapCheck = { NULL, NULL, dataBitmapBlockMask, visitDataBitmap, finishDataBitmap };
+
+/**
+ * Feature 3: Inode Bitmap Consistency Checker
+ * Checks each inode's bitmap bit against whether the inode is valid.
+ */
+static void visitInodeBitmap(VsfsckContext *ctx, ScanState *state, uint32_t i, const Inode *inode, bool isValid) {
+    (void)inode;
+    if (ctx->reportRanges) {
+        return;
+    }
+    bool marked = testBit(ctx->inodeBitmap, i);
+    if (marked && !isValid) {
+        reportFinding(state->reporter, CHECK_INODE_MARKED_INVALID, i, -1, "Inode %u marked used in bitmap but is invalid.", i);
+    }
+    if (!marked && isValid) {
+        reportFinding(state->reporter, CHECK_INODE_VALID_UNMARKED, i, -1, "Inode %u is valid but not marked used in bitmap.", i);
+    }
+}
+
+static uint64_t inodeBitmapMask(const VsfsckContext *ctx, size_t w) {
+    return ctx->inodeBitmap[w] ^ ctx->inodeUsed[w];
+}
+
+static uint64_t inodeMarkedInvalidMask(const VsfsckContext *ctx, size_t w) {
+    return ctx->inodeBitmap[w] & ~ctx->inodeUsed[w];
+}
+
+static uint64_t inodeValidUnmarkedMask(const VsfsckContext *ctx, size_t w) {
+    return ~ctx->inodeBitmap[w] & ctx->inodeUsed[w];
+}
+
+static void reportInodeBitmapRun(VsfsckContext *ctx, bool markedInvalid, uint32_t start, uint32_t length) {
+    length = clipRange(&ctx->reporter, length);
+    if (length == 0) {
+        return;
+    }
+    uint32_t last = start + length - 1;
+    if (markedInvalid && length == 1) {
+        reportFinding(&ctx->reporter, CHECK_INODE_MARKED_INVALID, start, -1, "Inode %u marked used in bitmap but is invalid.", start);
+    } else if (markedInvalid) {
+        reportRange(&ctx->reporter, CHECK_INODE_MARKED_INVALID, length, start, -1,
+                    "Inodes %u-%u (%u) marked used in bitmap but are invalid.", start, last, length);
+    } else if (length == 1) {
+        reportFinding(&ctx->reporter, CHECK_INODE_VALID_UNMARKED, start, -1, "Inode %u is valid but not marked used in bitmap.", start);
+    } else {
+        reportRange(&ctx->reporter, CHECK_INODE_VALID_UNMARKED, length, start, -1,
+                    "Inodes %u-%u (%u) are valid but not marked used in bitmap.", start, last, length);
+    }
+}
+
+static void finishInodeBitmap(VsfsckContext *ctx) {
+    if (ctx->reportRanges) {
+        reportMaskRuns(ctx, inodeBitmapMask, inodeMarkedInvalidMask, inodeValidUnmarkedMask, ctx->geo.inodeCount,
+                       reportInodeBitmapRun);
+    }
+    if (ctx->reporter.counts[CHECK_INODE_MARKED_INVALID] == 0 && ctx->reporter.counts[CHECK_INODE_VALID_UNMARKED] == 0) {
+        reportStatus(ctx, "Inode bitmap is consistent.");
+    }
+}
+
+static const CheckVisitors inodeBitmapCheck = { visitInodeBitmap, NULL, NULL, NULL, finishInodeBitmap };
+
+//Records the pointer to block if the scan left it unrecorded, and returns true if block was already marked.
+static bool noteOwner(Reporter *reporter, OwnerMap *map, uint32_t block, uint32_t inode, uint32_t parent, uint32_t slot) {
+    if (testBit(map->wanted, block)) {
+        clearBit(map->wanted, block);
+        appendOwner(reporter, map, block, inode, parent, slot);
+        map->remaining--;
+    }
+    bool seen = testBit(map->used, block);
+    setBit(map->used, block);
+    return seen;
+}
+
+static void collectOwnersBelow(VsfsckContext *ctx, Image *img, OwnerMap *map, uint32_t inode, uint32_t blockNum, int level) {
+    uint32_t buffer[PTRS_PER_BLOCK];
+    const uint32_t *view = viewBlock(ctx, img, ctx->geo.dataBlockStart + blockNum, buffer);
+    uint32_t ptrs[PTRS_PER_BLOCK];
+    memcpy(ptrs, view, BLOCK_SIZE);
+    for (uint32_t k = 0; k < PTRS_PER_BLOCK && map->remaining; k++) {
+        uint32_t ptr = ptrs[k];
+        if (ptr == 0 || ptr >= ctx->geo.dataBlockCount) {
+            continue;
+        }
+        if (!noteOwner(&ctx->reporter, map, ptr, inode, blockNum, k) && level > 1) {
+            collectOwnersBelow(ctx, img, map, inode, ptr, level - 1);
+        }
+    }
+}
+
+/**
+ * Walks the valid inodes' trees again, in the same order and with the same rule
+ * for already-walked indirect blocks as the inode scan, and records the pointers to
+ * shared blocks that the scan could not: the first one to each block, and a worker
+ * range's first one to each of its RangeFirsts. A first pointer never comes after a
+ * recorded one, so the walk stops as soon as all are found. After an incremental scan
+ * the pointers come from its walk log instead, and no indirect block is read again.
+ * Only runs when there are shared blocks.
+ */
+static void collectBlockOwners(VsfsckContext *ctx, Image *img, OwnerMap *map) {
+    size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+    map->used = imageCalloc(&ctx->reporter, words, sizeof(uint64_t));
+    map->wanted = imageCalloc(&ctx->reporter, words, sizeof(uint64_t));
+    if (!map->used || !map->wanted) {
+        return;
+    }
+    map->remaining = map->rangeFirstCount;
+    for (size_t w = 0; w < words; w++) {
+        map->wanted[w] = ctx->dataBlockShared[w];
+        map->remaining += (uint64_t)__builtin_popcountll(map->wanted[w]);
+    }
+    const WalkLog *log = ctx->currentLog.blockStart ? &ctx->currentLog : NULL;
+    uint64_t next = 0;
+    size_t nextFirst = 0;
+    for (uint32_t i = 0; i < ctx->geo.inodeCount && map->remaining; i++) {
+        if (log && i % INODES_PER_BLOCK == 0) {
+            next = log->blockStart[i / INODES_PER_BLOCK];
+        }
+        // An earlier range has already met the block, so its wanted bit is clear again
+        for (; nextFirst < map->rangeFirstCount && map->rangeFirsts[nextFirst].inode <= i; nextFirst++) {
+            setBit(map->wanted, map->rangeFirsts[nextFirst].block);
+        }
+        const Inode *inode = getInode(ctx, i);
+        if (inode->links == 0 || inode->dtime != 0) {
+            continue;
+        }
+        if (inode->direct < ctx->geo.dataBlockCount) {
+            noteOwner(&ctx->reporter, map, inode->direct, i, NO_OWNER_PARENT, 0);
+        }
+        if (log) {
+            WalkCursor cursor = { .depth = 0 };
+            uint64_t end = log->blockStart[i / INODES_PER_BLOCK + 1];
+            for (; next < end && (log->events[next].head & 0xff) == i % INODES_PER_BLOCK; next++) {
+                const WalkEvent *event = &log->events[next];
+                uint32_t parent;
+                uint32_t slot;
+                if (event->head >> 8 != WALK_BAD_ENTRY) {
+                    followWalkEvent(&cursor, event, &parent, &slot);
+                    noteOwner(&ctx->reporter, map, event->block, i, parent, slot);
+                }
+            }
+            continue;
+        }
+        uint32_t roots[3] = { inode->indirect, inode->doubleIndirect, inode->tripleIndirect };
+        for (int level = 1; level <= 3; level++) {
+            uint32_t root = roots[level - 1];
+            if (root != 0 && root < ctx->geo.dataBlockCount && !noteOwner(&ctx->reporter, map, root, i, NO_OWNER_PARENT, level)) {
+                collectOwnersBelow(ctx, img, map, i, root, level);
+            }
+        }
+    }
+}
+
+static int compareBlockOwners(const void *a, const void *b) {
+    const BlockOwner *x = a;
+    const BlockOwner *y = b;
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    if (x->parent != y->parent) {
+        return x->parent < y->parent ? -1 : 1;
+    }
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+static void describeOwner(FILE *out, const BlockOwner *owner) {
+    static const char *rootNames[4] = { "direct", "single indirect", "double indirect", "triple indirect" };
+    if (owner->parent == NO_OWNER_PARENT) {
+        fprintf(out, "inode %u (%s pointer)", owner->inode, rootNames[owner->slot]);
+    } else {
+        fprintf(out, "inode %u (entry %u of indirect block %u)", owner->inode, owner->slot, owner->parent);
+    }
+}
+
+/**
+ * Feature 4: Duplicate Block Checker
+ * Prepares the block pass to report data blocks referenced more than once: resets
+ * the cursor into the owner map and, if the scan marked any block as shared, finds
+ * the first owner of each one and sorts the owners by block for visitDuplicate().
+ */
+static void prepareDuplicates(VsfsckContext *ctx, Image *img) {
+    ctx->nextDuplicateOwner = 0;
+    bool duplicateFound = false;
+    size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+    for (size_t w = 0; w < words && !duplicateFound; w++) {
+        duplicateFound = ctx->dataBlockShared[w] != 0;
+    }
+    if (!duplicateFound) {
+        return;
+    }
+    collectBlockOwners(ctx, img, &ctx->duplicateOwners);
+    qsort(ctx->duplicateOwners.owners, ctx->duplicateOwners.count, sizeof(BlockOwner), compareBlockOwners);
+}
+
+static uint64_t duplicateMask(const VsfsckContext *ctx, size_t w) {
+    return ctx->dataBlockShared[w];
+}
+
+//Reports block with its owners. Blocks are visited in order, like the sorted owners.
+static void visitDuplicate(VsfsckContext *ctx, uint32_t block) {
+    OwnerMap *map = &ctx->duplicateOwners;
+    while (ctx->nextDuplicateOwner < map->count && map->owners[ctx->nextDuplicateOwner].block < block) {
+        ctx->nextDuplicateOwner++;
+    }
+    char *list = NULL;
+    size_t listLength = 0;
+    FILE *out = open_memstream(&list, &listLength);
+    if (!out) {
+        ctx->reporter.outOfMemory = true;
+        return;
+    }
+    for (size_t first = ctx->nextDuplicateOwner; ctx->nextDuplicateOwner < map->count &&
+         map->owners[ctx->nextDuplicateOwner].block == block; ctx->nextDuplicateOwner++) {
+        fputs(ctx->nextDuplicateOwner == first ? "" : ", ", out);
+        describeOwner(out, &map->owners[ctx->nextDuplicateOwner]);
+    }
+    fclose(out);
+    reportFinding(&ctx->reporter, CHECK_DUPLICATE_BLOCK, -1, block,
+                  "Data block %u is referenced by multiple inodes: %s.", block, list);
+    free(list);
+}
+
+static void finishDuplicates(VsfsckContext *ctx) {
+    if (!ctx->duplicateOwners.used && !ctx->reporter.outOfMemory) {
+        reportStatus(ctx, "No duplicate data block references found.");
+    }
+    freeOwnerMap(&ctx->duplicateOwners);
+}
+
+static const CheckVisitors duplicateCheck = { NULL, prepareDuplicates, duplicateMask, visitDuplicate, finishDuplicates };
+
+/**
+ * Feature 5: Bad Block Checker
+ * Reports direct and indirect root pointers of a valid inode that lie outside the
+ * data region. Bad entries inside indirect blocks are reported by the tree walk.
+ */
+static void visitInodePointers(VsfsckContext *ctx, ScanState *state, uint32_t i, const Inode *inode, bool isValid) {
+    if (!isValid) {
+        return;
+    }
+
+    if (inode->direct >= ctx->geo.dataBlockCount) {
+        reportFinding(state->reporter, CHECK_BAD_DIRECT, i, inode->direct, "Inode %u has invalid direct block %u.", i, inode->direct);
+    }
+
+    if (inode->indirect >= ctx->geo.dataBlockCount && inode->indirect != 0) {
+        reportFinding(state->reporter, CHECK_BAD_INDIRECT, i, inode->indirect,
+                      "Inode %u has invalid single indirect block %u.", i, inode->indirect);
+    }
+
+    if (inode->doubleIndirect >= ctx->geo.dataBlockCount && inode->doubleIndirect != 0) {
+        reportFinding(state->reporter, CHECK_BAD_DOUBLE_INDIRECT, i, inode->doubleIndirect,
+                      "Inode %u has invalid double indirect block %u.", i, inode->doubleIndirect);
+    }
+
+    if (inode->tripleIndirect >= ctx->geo.dataBlockCount && inode->tripleIndirect != 0) {
+        reportFinding(state->reporter, CHECK_BAD_TRIPLE_INDIRECT, i, inode->tripleIndirect,
+                      "Inode %u has invalid triple indirect block %u.", i, inode->tripleIndirect);
+    }
+}
+
+static void finishInodePointers(VsfsckContext *ctx) {
+    uint64_t bad = ctx->reporter.counts[CHECK_BAD_DIRECT] + ctx->reporter.counts[CHECK_BAD_INDIRECT] +
+                   ctx->reporter.counts[CHECK_BAD_DOUBLE_INDIRECT] + ctx->reporter.counts[CHECK_BAD_TRIPLE_INDIRECT] +
+                   ctx->reporter.counts[CHECK_INDIRECT_BAD_ENTRY];
+    if (bad == 0) {
+        reportStatus(ctx, "No invalid block references found in inodes.");
+    }
+}
+
+static const CheckVisitors badBlockCheck = { visitInodePointers, NULL, NULL, NULL, finishInodePointers };
+
+/**
+ * State of the directory pass. All maps are flat arrays indexed by inode number,
+ * so recording and looking up an entry is O(1) and the pass is linear in the
+ * number of directory entries.
+ */
+typedef struct {
+    Image *img;
+    // Directory entries naming each inode, "." and ".." included
+    uint32_t *references;
+    // Directory holding the first entry that names each directory, or NO_PARENT
+    uint32_t *parent;
+    // Target of each directory's ".." entry, or NO_PARENT
+    uint32_t *dotDot;
+    // Directory being parsed and how many of its bytes are left
+    uint32_t dir;
+    uint64_t remaining;
+    bool sawDot;
+} DirScan;
+
+#define NO_PARENT UINT32_MAX
+
+//Returns true if the inode is in use and a directory.
+static bool isDirectory(const Inode *inode) {
+    return inode->links > 0 && inode->dtime == 0 && S_ISDIR(inode->mode);
+}
+
+//Room for an entry name with every byte escaped
+#define SHOWN_NAME_LENGTH (DIR_NAME_LENGTH * 4 + 1)
+
+//Copies a name read from disk into shown for a message, escaping bytes outside
+//printable ASCII, quotes and backslashes as \xNN so that text output carries no
+//control bytes and NDJSON output stays valid UTF-8. Returns shown.
+static const char *showName(char shown[SHOWN_NAME_LENGTH], const char *name) {
+    char *out = shown;
+    for (const char *p = name; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out += sprintf(out, "\\x%02x", c);
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out = '\0';
+    return shown;
+}
+
+//Records the entries of one directory data block.
+static void scanDirBlock(VsfsckContext *ctx, DirScan *scan, const uint8_t *block) {
+    size_t bytes = scan->remaining < BLOCK_SIZE ? scan->remaining : BLOCK_SIZE;
+    scan->remaining -= bytes;
+    for (size_t offset = 0; offset + DIR_ENTRY_SIZE <= bytes; offset += DIR_ENTRY_SIZE) {
+        const DirEntry *entry = (const DirEntry *)(block + offset);
+        if (entry->name[0] == '\0') {
+            continue;
+        }
+        char name[DIR_NAME_LENGTH + 1];
+        memcpy(name, entry->name, DIR_NAME_LENGTH);
+        name[DIR_NAME_LENGTH] = '\0';
+        uint32_t target = entry->inode;
+        char shown[SHOWN_NAME_LENGTH];
+
+        if (target >= ctx->geo.inodeCount) {
+            reportFinding(&ctx->reporter, CHECK_DIR_BAD_ENTRY, scan->dir, -1,
+                          "Directory inode %u entry \"%s\" references invalid inode %u.", scan->dir,
+                          showName(shown, name), target);
+            continue;
+        }
+        const Inode *inode = getInode(ctx, target);
+        if (inode->links == 0 || inode->dtime != 0) {
+            reportFinding(&ctx->reporter, CHECK_DIR_FREE_ENTRY, scan->dir, -1,
+                          "Directory inode %u entry \"%s\" references free inode %u.", scan->dir,
+                          showName(shown, name), target);
+            continue;
+        }
+        scan->references[target]++;
+
+        if (strcmp(name, ".") == 0) {
+            scan->sawDot = true;
+            if (target != scan->dir) {
+                reportFinding(&ctx->reporter, CHECK_DIR_DOT_ENTRY, scan->dir, -1,
+                              "Directory inode %u has \".\" pointing to inode %u.", scan->dir, target);
+            }
+        } else if (strcmp(name, "..") == 0) {
+            scan->dotDot[scan->dir] = target;
+        } else if (S_ISDIR(inode->mode)) {
+            if (target == ROOT_INODE || scan->parent[target] != NO_PARENT) {
+                reportFinding(&ctx->reporter, CHECK_DIR_MULTIPLE_PARENTS, target, -1,
+                              "Directory inode %u is linked from directory %u and also from %u.", target,
+                              target == ROOT_INODE ? ROOT_INODE : scan->parent[target], scan->dir);
+            } else {
+                scan->parent[target] = scan->dir;
+            }
+        }
+    }
+}
+
+//Walks a directory's indirect tree in file order, parsing data blocks at level 0.
+//Holes and out-of-range pointers count as empty directory blocks.
+static void scanDirTree(VsfsckContext *ctx, DirScan *scan, uint32_t ptr, int level) {
+    uint64_t span = BLOCK_SIZE;
+    for (int l = 0; l < level; l++) {
+        span *= PTRS_PER_BLOCK;
+    }
+    if (scan->remaining == 0) {
+        return;
+    }
+    if ((level > 0 && ptr == 0) || ptr >= ctx->geo.dataBlockCount) {
+        scan->remaining = scan->remaining > span ? scan->remaining - span : 0;
+        return;
+    }
+
+    uint32_t buffer[PTRS_PER_BLOCK];
+    const void *block = viewBlock(ctx, scan->img, ctx->geo.dataBlockStart + ptr, buffer);
+    if (level == 0) {
+        scanDirBlock(ctx, scan, block);
+        return;
+    }
+    uint32_t ptrs[PTRS_PER_BLOCK];
+    memcpy(ptrs, block, BLOCK_SIZE);
+    for (size_t k = 0; k < PTRS_PER_BLOCK && scan->remaining > 0; k++) {
+        scanDirTree(ctx, scan, ptrs[k], level - 1);
+    }
+}
+
+/**
+ * Feature 6: Directory Tree and Link Count Checker
+ * Parses every directory, then verifies that each directory hangs off exactly one
+ * parent on a path to the root, that no in-use inode is unreachable and that every
+ * inode's link count equals the number of directory entries naming it. Parent
+ * chains are resolved with a per-inode memo, so each one is followed only once.
+ */
+static void checkDirectories(VsfsckContext *ctx, Image *img) {
+    const Inode *root = getInode(ctx, ROOT_INODE);
+    if (ctx->geo.inodeCount == 0 || !isDirectory(root)) {
+        reportFinding(&ctx->reporter, CHECK_ROOT_NOT_DIRECTORY, ROOT_INODE, -1,
+                      "Root inode %u is not an in-use directory.", ROOT_INODE);
+        return;
+    }
+
+    DirScan scan;
+    scan.img = img;
+    scan.references = imageCalloc(&ctx->reporter, ctx->geo.inodeCount, sizeof(uint32_t));
+    scan.parent = imageCalloc(&ctx->reporter, ctx->geo.inodeCount, sizeof(uint32_t));
+    scan.dotDot = imageCalloc(&ctx->reporter, ctx->geo.inodeCount, sizeof(uint32_t));
+    uint8_t *reach = imageCalloc(&ctx->reporter, ctx->geo.inodeCount, 1);
+    uint32_t *chain = imageCalloc(&ctx->reporter, ctx->geo.inodeCount, sizeof(uint32_t));
+    if (ctx->reporter.outOfMemory) {
+        free(scan.references);
+        free(scan.parent);
+        free(scan.dotDot);
+        free(reach);
+        free(chain);
+        return;
+    }
+    memset(scan.parent, 0xff, ctx->geo.inodeCount * sizeof(uint32_t));
+    memset(scan.dotDot, 0xff, ctx->geo.inodeCount * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < ctx->geo.inodeCount; i++) {
+        const Inode *inode = getInode(ctx, i);
+        if (!isDirectory(inode)) {
+            continue;
+        }
+        scan.dir = i;
+        scan.remaining = inode->size;
+        scan.sawDot = false;
+        uint32_t roots[4] = { inode->direct, inode->indirect, inode->doubleIndirect, inode->tripleIndirect };
+        for (int level = 0; level < 4; level++) {
+            scanDirTree(ctx, &scan, roots[level], level);
+        }
+        if (!scan.sawDot) {
+            reportFinding(&ctx->reporter, CHECK_DIR_DOT_ENTRY, i, -1, "Directory inode %u is missing its \".\" entry.", i);
+        }
+        if (scan.dotDot[i] == NO_PARENT) {
+            reportFinding(&ctx->reporter, CHECK_DIR_DOT_ENTRY, i, -1, "Directory inode %u is missing its \"..\" entry.", i);
+        }
+    }
+
+    // Resolve whether each directory reaches the root: 0 unknown, 1 on the current
+    // chain, 2 reaches the root, 3 does not
+    reach[ROOT_INODE] = 2;
+    for (uint32_t i = 0; i < ctx->geo.inodeCount; i++) {
+        if (reach[i] || !isDirectory(getInode(ctx, i))) {
+            continue;
+        }
+        size_t length = 0;
+        uint32_t d = i;
+        while (d != NO_PARENT && reach[d] == 0) {
+            reach[d] = 1;
+            chain[length++] = d;
+            d = scan.parent[d];
+        }
+        uint8_t result = d != NO_PARENT && reach[d] == 2 ? 2 : 3;
+        if (d == NO_PARENT) {
+            uint32_t top = chain[length - 1];
+            reportFinding(&ctx->reporter, CHECK_ORPHAN_INODE, top, -1,
+                          "Directory inode %u is not linked from any directory.", top);
+        } else if (reach[d] == 1) {
+            reportFinding(&ctx->reporter, CHECK_DIR_CYCLE, d, -1,
+                          "Directory inode %u is part of a cycle that does not reach the root.", d);
+        }
+        for (size_t k = 0; k < length; k++) {
+            reach[chain[k]] = result;
+        }
+    }
+
+    for (uint32_t i = 0; i < ctx->geo.inodeCount; i++) {
+        const Inode *inode = getInode(ctx, i);
+        if (inode->links == 0 || inode->dtime != 0) {
+            continue;
+        }
+        if (isDirectory(inode) && reach[i] == 2 && scan.dotDot[i] != NO_PARENT) {
+            uint32_t expected = i == ROOT_INODE ? ROOT_INODE : scan.parent[i];
+            if (scan.dotDot[i] != expected) {
+                reportFinding(&ctx->reporter, CHECK_DIR_DOT_ENTRY, i, -1,
+                              "Directory inode %u has \"..\" pointing to inode %u instead of its parent %u.",
+                              i, scan.dotDot[i], expected);
+            }
+        }
+        if (scan.references[i] == 0) {
+            if (!isDirectory(inode)) {
+                reportFinding(&ctx->reporter, CHECK_ORPHAN_INODE, i, -1, "Inode %u is not linked from any directory.", i);
+            }
+        } else if (scan.references[i] != inode->links) {
+            reportFinding(&ctx->reporter, CHECK_LINK_COUNT, i, -1,
+                          "Inode %u has link count %u but %u directory entries.", i, inode->links, scan.references[i]);
+        }
+    }
+
+    free(reach);
+    free(chain);
+    free(scan.references);
+    free(scan.parent);
+    free(scan.dotDot);
+}
+
+/**
+ * Deep scan. Every referenced data block is hashed with CRC32C, using the SSE4.2
+ * crc32 instruction when the CPU has it, and compared against a sidecar manifest
+ * recorded by an earlier run. The manifest holds this header, a bitset of the
+ * data blocks it recorded and one checksum per data block.
+ */
+#define CHECKSUM_MAGIC 0x314d555353465356ULL
+
+typedef struct {
+    uint64_t magic;
+    uint32_t dataBlockStart;
+    uint32_t dataBlockCount;
+} ChecksumHeader;
+
+static uint32_t crc32cTable[256];
+
+static uint32_t crc32cSoftware(uint32_t crc, const uint8_t *p, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        crc = crc32cTable[(crc ^ p[k]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t *p, size_t n) {
+    uint64_t c = crc;
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        uint64_t w;
+        memcpy(&w, p + k, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; k < n; k++) {
+        c = _mm_crc32_u8((uint32_t)c, p[k]);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// The table and the selected implementation are shared by all contexts and set up once
+static uint32_t (*crc32cUpdate)(uint32_t crc, const uint8_t *p, size_t n);
+static const char *crc32cEngine;
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+//Selects the CRC32C implementation and names it for the throughput report.
+static void initCrc32c() {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32cTable[b] = crc;
+    }
+    crc32cUpdate = crc32cSoftware;
+    crc32cEngine = "table";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32cUpdate = crc32cHardware;
+        crc32cEngine = "sse4.2";
+    }
+#endif
+}
+
+static uint32_t crc32cBlock(const uint8_t *block) {
+    return ~crc32cUpdate(~0u, block, BLOCK_SIZE);
+}
+
+// One hashing thread's share of the data region
+typedef struct {
+    VsfsckContext *ctx;
+    Image *img;
+    uint32_t first;
+    uint32_t end;
+    uint32_t *sums;
+    // Checksum of a block of zeros, for blocks in holes
+    uint32_t zeroSum;
+    uint64_t blocks;
+    uint64_t holes;
+} HashWorker;
+
+//Hashes the referenced data blocks in [first, end), reading contiguous runs with one call.
+//Blocks in holes are not read; they get the checksum of zeros. In snapshot mode every
+//block hashed is recorded, so a torn read makes the check repeat.
+static void *hashWorkerMain(void *arg) {
+    HashWorker *worker = arg;
+    VsfsckContext *ctx = worker->ctx;
+    PhaseStats *st = &ctx->phaseStats[ctx->currentPhase];
+    uint8_t *buffer = xalignedAlloc(DEEP_SCAN_RUN_BLOCKS, BLOCK_SIZE);
+    uint32_t b = worker->first;
+    while (b < worker->end) {
+        if (!testBit(ctx->dataBlockUsed, b)) {
+            b++;
+            continue;
+        }
+        if (isHole(worker->img, ctx->geo.dataBlockStart + b)) {
+            worker->sums[b] = worker->zeroSum;
+            worker->holes++;
+            b++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (run < DEEP_SCAN_RUN_BLOCKS && b + run < worker->end && testBit(ctx->dataBlockUsed, b + run) &&
+               !isHole(worker->img, ctx->geo.dataBlockStart + b + run)) {
+            run++;
+        }
+        size_t offset = ((size_t)ctx->geo.dataBlockStart + b) * BLOCK_SIZE;
+        const uint8_t *data = buffer;
+        countIo(&st->blockReads, run);
+        if (worker->img->map && offset + (size_t)run * BLOCK_SIZE <= worker->img->mapSize) {
+            data = worker->img->map + offset;
+            countIo(&st->cacheHits, run);
+        } else {
+            ssize_t got = pread(worker->img->fd, buffer, (size_t)run * BLOCK_SIZE, offset);
+            if (got < 0) {
+                got = 0;
+            }
+            memset(buffer + got, 0, (size_t)run * BLOCK_SIZE - got);
+            countIo(&st->syscalls, 1);
+            countIo(&st->bytesRead, got);
+        }
+        for (uint32_t k = 0; k < run; k++) {
+            worker->sums[b + k] = crc32cBlock(data + (size_t)k * BLOCK_SIZE);
+            if (ctx->snapshotting) {
+                recordSnapshotRead(ctx, ctx->geo.dataBlockStart + b + k, data + (size_t)k * BLOCK_SIZE);
+            }
+        }
+        worker->blocks += run;
+        b += run;
+    }
+    free(buffer);
+    return NULL;
+}
+
+//Loads a checksum manifest recorded for this layout into recorded and sums.
+static bool loadChecksums(VsfsckContext *ctx, const char *path, uint64_t *recorded, uint32_t *sums) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        reportDiagnostic(ctx, "Failed to open checksum manifest: %s", strerror(errno));
+        return false;
+    }
+    ChecksumHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == CHECKSUM_MAGIC &&
+              header.dataBlockStart == ctx->geo.dataBlockStart && header.dataBlockCount == ctx->geo.dataBlockCount;
+    if (!ok) {
+        reportDiagnostic(ctx, "Checksum manifest %s does not belong to this image layout.", path);
+    } else {
+        size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+        ok = fread(recorded, sizeof(uint64_t), words, fp) == words &&
+             fread(sums, sizeof(uint32_t), ctx->geo.dataBlockCount, fp) == ctx->geo.dataBlockCount;
+        if (!ok) {
+            reportDiagnostic(ctx, "Checksum manifest %s is truncated.", path);
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void saveChecksums(VsfsckContext *ctx, const char *path, const uint32_t *sums) {
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        reportDiagnostic(ctx, "Failed to write checksum manifest: %s", strerror(errno));
+        return;
+    }
+    ChecksumHeader header = { CHECKSUM_MAGIC, ctx->geo.dataBlockStart, ctx->geo.dataBlockCount };
+    size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(ctx->dataBlockUsed, sizeof(uint64_t), words, fp) == words &&
+              fwrite(sums, sizeof(uint32_t), ctx->geo.dataBlockCount, fp) == ctx->geo.dataBlockCount;
+    if (fclose(fp) != 0 || !ok || rename(tmpPath, path) != 0) {
+        reportDiagnostic(ctx, "Failed to write checksum manifest: %s", strerror(errno));
+        remove(tmpPath);
+    }
+}
+
+/**
+ * Feature 7: Data Checksum Checker
+ * Hashes every referenced data block across threads, then reports blocks whose
+ * checksum differs from verifyPath's and/or writes a new manifest to recordPath.
+ * Blocks referenced now but not when the manifest was recorded are not compared.
+ * Hashing throughput is reported as a diagnostic.
+ */
+static void checkDataChecksums(VsfsckContext *ctx, Image *img, int threads, const char *verifyPath, const char *recordPath) {
+    pthread_once(&crc32cOnce, initCrc32c);
+    uint32_t *sums = imageCalloc(&ctx->reporter, ctx->geo.dataBlockCount, sizeof(uint32_t));
+    uint64_t *recorded = NULL;
+    uint32_t *expected = NULL;
+    if (verifyPath) {
+        recorded = imageCalloc(&ctx->reporter, BITSET_WORDS(ctx->geo.dataBlockCount), sizeof(uint64_t));
+        expected = imageCalloc(&ctx->reporter, ctx->geo.dataBlockCount, sizeof(uint32_t));
+    }
+    if (ctx->reporter.outOfMemory) {
+        free(sums);
+        free(recorded);
+        free(expected);
+        return;
+    }
+    if (verifyPath) {
+        if (!loadChecksums(ctx, verifyPath, recorded, expected)) {
+            free(recorded);
+            free(expected);
+            recorded = NULL;
+            expected = NULL;
+        }
+    }
+
+    // Ranges are multiples of 64 blocks so no two threads test the same bitset word
+    uint32_t perThread = (uint32_t)((((uint64_t)ctx->geo.dataBlockCount + threads - 1) / threads + 63) / 64 * 64);
+    HashWorker *workers = xcalloc(threads, sizeof(HashWorker));
+    pthread_t *tids = xcalloc(threads, sizeof(pthread_t));
+    int started = 0;
+    double start = monotonicSeconds();
+    for (uint32_t first = 0; first < ctx->geo.dataBlockCount; first += perThread) {
+        HashWorker *worker = &workers[started];
+        worker->ctx = ctx;
+        worker->img = img;
+        worker->first = first;
+        worker->end = ctx->geo.dataBlockCount - first > perThread ? first + perThread : ctx->geo.dataBlockCount;
+        worker->sums = sums;
+        worker->zeroSum = crc32cBlock(zeroBlock);
+        if (pthread_create(&tids[started], NULL, hashWorkerMain, worker) != 0) {
+            perror("Failed to start hash thread");
+            exit(EXIT_FAILURE);
+        }
+        started++;
+    }
+    uint64_t hashed = 0;
+    uint64_t holes = 0;
+    for (int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+        hashed += workers[t].blocks;
+        holes += workers[t].holes;
+    }
+    double seconds = monotonicSeconds() - start;
+
+    uint64_t compared = 0;
+    if (expected) {
+        bool mismatch = false;
+        for (uint32_t b = 0; b < ctx->geo.dataBlockCount; b++) {
+            if (!testBit(ctx->dataBlockUsed, b) || !testBit(recorded, b)) {
+                continue;
+            }
+            compared++;
+            if (sums[b] != expected[b]) {
+                reportFinding(&ctx->reporter, CHECK_DATA_CHECKSUM, -1, b,
+                              "Data block %u content does not match its recorded checksum.", b);
+                mismatch = true;
+            }
+        }
+        if (!mismatch) {
+            reportStatus(ctx, "All recorded data block checksums match.");
+        }
+    }
+    if (recordPath) {
+        saveChecksums(ctx, recordPath, sums);
+    }
+
+    double bytes = (double)hashed * BLOCK_SIZE;
+    reportDiagnostic(ctx, "deep scan: %llu blocks (%.1f MiB, %llu compared, %llu in holes) hashed in %.3f s, %.2f GB/s, %d threads, crc32c %s",
+                     (unsigned long long)hashed, bytes / (1 << 20), (unsigned long long)compared,
+                     (unsigned long long)holes, seconds, seconds > 0 ? bytes / seconds / 1e9 : 0.0, started, crc32cEngine);
+    free(workers);
+    free(tids);
+    free(sums);
+    free(recorded);
+    free(expected);
+}
+
+/**
+ * A set of whole blocks to write back to the image. Blocks are staged in memory
+ * during repair and written in block order by writeBatch().
+ */
+typedef struct {
+    uint32_t block;
+    uint8_t *data;
+} StagedBlock;
+
+typedef struct {
+    StagedBlock *blocks;
+    size_t count;
+    size_t capacity;
+    uint8_t scratch[BLOCK_SIZE];
+} WriteBatch;
+
+/**
+ * Appends a zeroed block buffer for absolute block blockNum to the batch and returns
+ * it. Without memory for it the block is not staged and the batch's scratch buffer
+ * is returned instead, so callers can fill it as usual; repairImage() then writes
+ * nothing.
+ */
+static uint8_t *stageBlock(Reporter *reporter, WriteBatch *batch, uint32_t blockNum) {
+    if (batch->count == batch->capacity) {
+        StagedBlock *grown = growArray(reporter, batch->blocks, &batch->capacity, sizeof(StagedBlock), 64);
+        if (!grown) {
+            return batch->scratch;
+        }
+        batch->blocks = grown;
+    }
+    uint8_t *data = imageAlignedAlloc(reporter, 1, BLOCK_SIZE);
+    if (!data) {
+        return batch->scratch;
+    }
+    StagedBlock *staged = &batch->blocks[batch->count++];
+    staged->block = blockNum;
+    staged->data = data;
+    return staged->data;
+}
+
+static int compareStagedBlocks(const void *a, const void *b) {
+    return compareBlockNums(&((const StagedBlock *)a)->block, &((const StagedBlock *)b)->block);
+}
+
+/**
+ * Writes a batch in one sequential sweep: blocks are sorted, each contiguous run
+ * is issued as a single pwritev, and the batch is made durable with fsync before
+ * returning. Returns false on a write error.
+ */
+static bool writeBatch(VsfsckContext *ctx, Image *img, WriteBatch *batch) {
+    qsort(batch->blocks, batch->count, sizeof(StagedBlock), compareStagedBlocks);
+    struct iovec iov[WRITE_RUN_BLOCKS];
+    size_t k = 0;
+    while (k < batch->count) {
+        uint32_t first = batch->blocks[k].block;
+        int n = 0;
+        while (k < batch->count && n < WRITE_RUN_BLOCKS && batch->blocks[k].block == first + (uint32_t)n) {
+            iov[n].iov_base = batch->blocks[k].data;
+            iov[n].iov_len = BLOCK_SIZE;
+            n++;
+            k++;
+        }
+        countIo(&ctx->phaseStats[ctx->currentPhase].syscalls, 1);
+        if (pwritev(img->fd, iov, n, (off_t)first * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE) {
+            return false;
+        }
+    }
+    if (batch->count == 0) {
+        return true;
+    }
+    countIo(&ctx->phaseStats[ctx->currentPhase].syscalls, 1);
+    return fsync(img->fd) == 0;
+}
+
+static void freeBatch(WriteBatch *batch) {
+    for (size_t k = 0; k < batch->count; k++) {
+        free(batch->blocks[k].data);
+    }
+    free(batch->blocks);
+}
+
+/**
+ * State of a repair pass. owned holds the data blocks claimed by the rebuilt
+ * trees; the second claim of a block gets a copy in a block nobody referenced.
+ * blocks counts the blocks the inode being rebuilt keeps, for its blocks field.
+ */
+typedef struct {
+    Image *img;
+    uint64_t *owned;
+    uint32_t nextFree;
+    WriteBatch data;
+    WriteBatch inodes;
+    WriteBatch bitmaps;
+    uint64_t cloned;
+    uint64_t cleared;
+    uint32_t blocks;
+} Repair;
+
+//Claims a data block that no inode referenced, or returns false if none is left.
+//Block 0 is never handed out because a zero indirect entry means a hole.
+static bool allocateBlock(VsfsckContext *ctx, Repair *r, uint32_t *blockNum) {
+    while (r->nextFree < ctx->geo.dataBlockCount) {
+        uint32_t b = r->nextFree++;
+        if (b != 0 && !testBit(ctx->dataBlockUsed, b) && !testBit(r->owned, b)) {
+            setBit(r->owned, b);
+            *blockNum = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+//Returns the pointer to store for a reference to data block ptr: ptr itself on its
+//first claim, otherwise a fresh copy. A block stays shared if no free block is left.
+static uint32_t claimLeaf(VsfsckContext *ctx, Repair *r, uint32_t ptr) {
+    r->blocks++;
+    if (!testBit(r->owned, ptr)) {
+        setBit(r->owned, ptr);
+        return ptr;
+    }
+    uint32_t copy;
+    if (!allocateBlock(ctx, r, &copy)) {
+        return ptr;
+    }
+    uint8_t buffer[BLOCK_SIZE];
+    memcpy(stageBlock(&ctx->reporter, &r->data, ctx->geo.dataBlockStart + copy),
+           viewBlock(ctx, r->img, ctx->geo.dataBlockStart + ptr, buffer), BLOCK_SIZE);
+    r->cloned++;
+    return copy;
+}
+
+/**
+ * Rebuilds the indirect tree rooted at ptr: out-of-range entries become holes and
+ * blocks already claimed elsewhere are cloned, including whole shared subtrees.
+ * Returns the pointer to store for the root.
+ */
+static uint32_t repairTree(VsfsckContext *ctx, Repair *r, uint32_t ptr, int level) {
+    r->blocks++;
+    bool shared = testBit(r->owned, ptr);
+    uint32_t target = ptr;
+    if (shared && !allocateBlock(ctx, r, &target)) {
+        return ptr;
+    }
+    setBit(r->owned, target);
+
+    uint32_t buffer[PTRS_PER_BLOCK];
+    uint32_t ptrs[PTRS_PER_BLOCK];
+    memcpy(ptrs, viewBlock(ctx, r->img, ctx->geo.dataBlockStart + ptr, buffer), BLOCK_SIZE);
+    bool changed = shared;
+    for (size_t k = 0; k < PTRS_PER_BLOCK; k++) {
+        uint32_t entry = ptrs[k];
+        if (entry == 0) {
+            continue;
+        }
+        if (entry >= ctx->geo.dataBlockCount) {
+            ptrs[k] = 0;
+            r->cleared++;
+            changed = true;
+            continue;
+        }
+        uint32_t fixed = level == 1 ? claimLeaf(ctx, r, entry) : repairTree(ctx, r, entry, level - 1);
+        if (fixed != entry) {
+            ptrs[k] = fixed;
+            changed = true;
+        }
+    }
+    if (changed) {
+        memcpy(stageBlock(&ctx->reporter, &r->data, ctx->geo.dataBlockStart + target), ptrs, BLOCK_SIZE);
+    }
+    if (shared) {
+        r->cloned++;
+    }
+    return target;
+}
+
+//Stages the on-disk bytes of the bitmap blocks whose contents differ from what was loaded.
+static void stageBitmap(VsfsckContext *ctx, Repair *r, uint32_t firstBlock, const uint64_t *loaded, const uint64_t *rebuilt, uint32_t count) {
+    size_t words = BITSET_WORDS(count);
+    for (size_t base = 0; base < words; base += WORDS_PER_BLOCK) {
+        size_t end = base + WORDS_PER_BLOCK < words ? base + WORDS_PER_BLOCK : words;
+        if (memcmp(loaded + base, rebuilt + base, (end - base) * sizeof(uint64_t)) == 0) {
+            continue;
+        }
+        uint8_t *raw = stageBlock(&ctx->reporter, &r->bitmaps, firstBlock + base / WORDS_PER_BLOCK);
+        for (size_t w = base; w < end; w++) {
+            for (int b = 0; b < 8; b++) {
+                raw[(w - base) * 8 + b] = (uint8_t)(rebuilt[w] >> (8 * b));
+            }
+        }
+    }
+}
+
+//Number of set bits in the first words of a bitset.
+static uint64_t countBits(const uint64_t *set, size_t words) {
+    uint64_t count = 0;
+    for (size_t w = 0; w < words; w++) {
+        count += __builtin_popcountll(set[w]);
+    }
+    return count;
+}
+
+/**
+ * Feature 8: Quick Bitmap Count Checker
+ * Compares how many inodes and data blocks the bitmaps mark used with what the
+ * inode table alone implies: the number of valid inodes and the sum of their
+ * blocks fields. No tree is walked, so this reads only the metadata region; a
+ * mismatch says that the bitmaps and inodes disagree but not where.
+ */
+static void checkBitmapCounts(VsfsckContext *ctx) {
+    uint64_t validInodes = 0;
+    uint64_t referencedBlocks = 0;
+    for (uint32_t i = 0; i < ctx->geo.inodeCount; i++) {
+        const Inode *inode = getInode(ctx, i);
+        if (inode->links > 0 && inode->dtime == 0) {
+            validInodes++;
+            referencedBlocks += inode->blocks;
+        }
+    }
+
+    uint64_t markedInodes = countBits(ctx->inodeBitmap, BITSET_WORDS(ctx->geo.inodeCount));
+    uint64_t markedBlocks = countBits(ctx->dataBitmap, BITSET_WORDS(ctx->geo.dataBlockCount));
+    if (markedInodes != validInodes) {
+        reportFinding(&ctx->reporter, CHECK_INODE_BITMAP_COUNT, -1, -1,
+                      "Inode bitmap marks %llu inodes used but %llu inodes are valid.",
+                      (unsigned long long)markedInodes, (unsigned long long)validInodes);
+    }
+    if (markedBlocks != referencedBlocks) {
+        reportFinding(&ctx->reporter, CHECK_DATA_BITMAP_COUNT, -1, -1,
+                      "Data bitmap marks %llu blocks used but valid inodes account for %llu blocks.",
+                      (unsigned long long)markedBlocks, (unsigned long long)referencedBlocks);
+    }
+}
+
+/**
+ * Repair mode. Rebuilds the inode bitmap from the valid inodes and the data bitmap
+ * from the blocks they reach, clears out-of-range indirect pointers and entries,
+ * moves out-of-range direct pointers to a fresh zeroed block, and gives every
+ * repeated reference to a data block its own copy. Each inode's blocks field is
+ * set to the number of blocks its rebuilt tree holds. Changes are staged in memory
+ * and written in three ordered batches (new data blocks, inode table, bitmaps),
+ * each fsynced before the next, so the image never points at unwritten blocks.
+ */
+static void repairImage(VsfsckContext *ctx, Image *img) {
+    // Repair writes where the superblock points, so any doubt about it rules repair out;
+    // a total block count past the end of the file would let allocateBlock grow the image
+    if (ctx->reporter.counts[CHECK_SUPERBLOCK_MAGIC] || ctx->reporter.counts[CHECK_SUPERBLOCK_TOTAL_BLOCKS] ||
+        ctx->reporter.counts[CHECK_SUPERBLOCK_LAYOUT] || ctx->reporter.counts[CHECK_SUPERBLOCK_BLOCK_SIZE] ||
+        ctx->reporter.counts[CHECK_SUPERBLOCK_INODE_SIZE]) {
+        reportDiagnostic(ctx, "Repair skipped: superblock geometry is not trustworthy.");
+        return;
+    }
+
+    Repair r;
+    memset(&r, 0, sizeof(r));
+    r.img = img;
+    r.owned = imageCalloc(&ctx->reporter, BITSET_WORDS(ctx->geo.dataBlockCount), sizeof(uint64_t));
+    if (!r.owned) {
+        return;
+    }
+    r.nextFree = 1;
+
+    uint8_t *inodeBlock = NULL;
+    uint32_t inodeBlockIndex = UINT32_MAX;
+    for (uint32_t i = 0; i < ctx->geo.inodeCount; i++) {
+        if (!testBit(ctx->inodeUsed, i)) {
+            continue;
+        }
+        const Inode *inode = getInode(ctx, i);
+        Inode fixed;
+        memcpy(&fixed, inode, sizeof(Inode));
+        r.blocks = 0;
+
+        if (fixed.direct >= ctx->geo.dataBlockCount) {
+            uint32_t fresh;
+            if (allocateBlock(ctx, &r, &fresh)) {
+                stageBlock(&ctx->reporter, &r.data, ctx->geo.dataBlockStart + fresh);
+                fixed.direct = fresh;
+                r.cleared++;
+                r.blocks++;
+            }
+        } else {
+            fixed.direct = claimLeaf(ctx, &r, fixed.direct);
+        }
+
+        uint32_t roots[3] = { fixed.indirect, fixed.doubleIndirect, fixed.tripleIndirect };
+        for (int level = 1; level <= 3; level++) {
+            uint32_t root = roots[level - 1];
+            if (root >= ctx->geo.dataBlockCount) {
+                roots[level - 1] = 0;
+                r.cleared++;
+            } else if (root != 0) {
+                roots[level - 1] = repairTree(ctx, &r, root, level);
+            }
+        }
+        fixed.indirect = roots[0];
+        fixed.doubleIndirect = roots[1];
+        fixed.tripleIndirect = roots[2];
+        // Cleared entries and clones change what the tree holds
+        fixed.blocks = r.blocks;
+
+        if (memcmp(&fixed, inode, sizeof(Inode)) != 0) {
+            if (i / INODES_PER_BLOCK != inodeBlockIndex) {
+                inodeBlockIndex = i / INODES_PER_BLOCK;
+                inodeBlock = stageBlock(&ctx->reporter, &r.inodes, ctx->geo.inodeTableStart + inodeBlockIndex);
+                memcpy(inodeBlock, ctx->inodeTable + (size_t)inodeBlockIndex * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            memcpy(inodeBlock + (i % INODES_PER_BLOCK) * INODE_SIZE, &fixed, sizeof(Inode));
+        }
+    }
+
+    stageBitmap(ctx, &r, ctx->geo.inodeBitmapBlock, ctx->inodeBitmap, ctx->inodeUsed, ctx->geo.inodeCount);
+    stageBitmap(ctx, &r, ctx->geo.dataBitmapBlock, ctx->dataBitmap, r.owned, ctx->geo.dataBlockCount);
+
+    size_t written = r.data.count + r.inodes.count + r.bitmaps.count;
+    if (ctx->reporter.outOfMemory) {
+        reportDiagnostic(ctx, "Repair abandoned: not enough memory to stage the changes.");
+    } else if (!writeBatch(ctx, img, &r.data) || !writeBatch(ctx, img, &r.inodes) || !writeBatch(ctx, img, &r.bitmaps)) {
+        reportDiagnostic(ctx, "Repair failed while writing the image: %s", strerror(errno));
+    } else {
+        char message[160];
+        snprintf(message, sizeof(message), "Repair completed: %llu blocks cloned, %llu pointers cleared, %zu blocks written.",
+                 (unsigned long long)r.cloned, (unsigned long long)r.cleared, written);
+        reportStatus(ctx, message);
+    }
+
+    freeBatch(&r.data);
+    freeBatch(&r.inodes);
+    freeBatch(&r.bitmaps);
+    free(r.owned);
+}
+
+static int compareSnapshotReads(const void *a, const void *b) {
+    return compareBlockNums(&((const SnapshotRead *)a)->block, &((const SnapshotRead *)b)->block);
+}
+
+/**
+ * Reads every block recorded during the check again and returns true if all of
+ * them still hash to what the check saw, i.e. the check observed a single
+ * consistent state of the image. Clears the record either way.
+ */
+static bool verifySnapshot(VsfsckContext *ctx, Image *img) {
+    qsort(ctx->snapshotReads, ctx->snapshotCount, sizeof(SnapshotRead), compareSnapshotReads);
+    bool stable = true;
+    uint8_t buffer[BLOCK_SIZE];
+    uint64_t current = 0;
+    for (size_t k = 0; k < ctx->snapshotCount && stable; k++) {
+        if (k == 0 || ctx->snapshotReads[k].block != ctx->snapshotReads[k - 1].block) {
+            current = hashBlock(viewBlock(ctx, img, ctx->snapshotReads[k].block, buffer));
+        }
+        stable = ctx->snapshotReads[k].hash == current;
+    }
+    ctx->snapshotCount = 0;
+    return stable;
+}
+
+//Returns true, after saying so, once the error limit has been reached and the
+//remaining phases should be skipped.
+static bool errorLimitReached(VsfsckContext *ctx) {
+    if (!reporterFull(&ctx->reporter)) {
+        return false;
+    }
+    reportStatus(ctx, "Error limit reached; remaining checks skipped.");
+    return true;
+}
+
+//Returns true once the remaining phases should be skipped: a phase ran out of
+//memory for the image's state, or the error limit has been reached.
+static bool checksStopped(VsfsckContext *ctx) {
+    return ctx->reporter.outOfMemory || errorLimitReached(ctx);
+}
+
+//Registers the built-in checks with the engine. The order of registration is the
+//order of findings about the same inode or block.
+static void registerCoreChecks(VsfsckContext *ctx) {
+    registerCheck(ctx, &inodeBitmapCheck);
+    registerCheck(ctx, &badBlockCheck);
+    registerCheck(ctx, &fileTallyCheck);
+    registerCheck(ctx, &dataBitmapCheck);
+    registerCheck(ctx, &duplicateCheck);
+}
+
+/**
+ * Block pass of the engine: one sweep over the data block bitsets that visits the
+ * union of the blocks every check's mask selects, in block order, so findings
+ * about one block are adjacent.
+ */
+static void visitDataBlocks(VsfsckContext *ctx, Image *img) {
+    for (int c = 0; c < ctx->checkRegistryCount; c++) {
+        if (ctx->checkRegistry[c]->prepareBlocks) {
+            ctx->checkRegistry[c]->prepareBlocks(ctx, img);
+        }
+    }
+    if (ctx->reporter.outOfMemory) {
+        return;
+    }
+    uint64_t masks[MAX_CHECKS] = { 0 };
+    size_t words = BITSET_WORDS(ctx->geo.dataBlockCount);
+    for (size_t w = 0; w < words && !reporterFull(&ctx->reporter); w++) {
+        // On a consistent image nearly every chunk is clean, and skipping it spares
+        // the indirect mask calls
+        if (w % BLOCK_CHUNK_WORDS == 0) {
+            size_t end = w + BLOCK_CHUNK_WORDS < words ? w + BLOCK_CHUNK_WORDS : words;
+            uint64_t suspect = 0;
+            for (size_t k = w; k < end; k++) {
+                suspect |= (ctx->dataBitmap[k] ^ ctx->dataBlockUsed[k]) | ctx->dataBlockShared[k];
+            }
+            if (!suspect) {
+                w = end - 1;
+                continue;
+            }
+        }
+        uint64_t pending = 0;
+        for (int c = 0; c < ctx->checkRegistryCount; c++) {
+            masks[c] = ctx->checkRegistry[c]->blockMask ? ctx->checkRegistry[c]->blockMask(ctx, w) : 0;
+            pending |= masks[c];
+        }
+        while (pending) {
+            int bit = __builtin_ctzll(pending);
+            pending &= pending - 1;
+            for (int c = 0; c < ctx->checkRegistryCount; c++) {
+                if (masks[c] >> bit & 1) {
+                    ctx->checkRegistry[c]->visitBlock(ctx, (uint32_t)(w * 64 + bit));
+                }
+            }
+        }
+    }
+}
+
+//Runs every check's finish visitor.
+static void finishChecks(VsfsckContext *ctx) {
+    for (int c = 0; c < ctx->checkRegistryCount; c++) {
+        if (ctx->checkRegistry[c]->finish) {
+            ctx->checkRegistry[c]->finish(ctx);
+        }
+    }
+}
+
+//Triage options trade completeness for speed and report the outcome in the exit status.
+static bool triageMode(const VsfsckOptions *opts) {
+    return opts->quick || opts->maxErrors;
+}
+
+//Runs every check phase on an opened image, reporting through the context's reporter.
+static void runChecks(VsfsckContext *ctx, Image *img, const VsfsckOptions *opts) {
+    // Superblock is 4 bytes short of the block it is read from
+    uint32_t superblockBuffer[PTRS_PER_BLOCK];
+    beginPhase(ctx, PHASE_SUPERBLOCK);
+    readSuperblock(ctx, img, superblockBuffer);
+    endPhase(ctx);
+    reportStatus(ctx, "Superblock validation completed.");
+    if (errorLimitReached(ctx)) {
+        return;
+    }
+
+    beginPhase(ctx, PHASE_BITMAPS);
+    if (!allocTracking(ctx)) {
+        endPhase(ctx);
+        return;
+    }
+    loadBitmap(ctx, img, ctx->geo.inodeBitmapBlock, ctx->inodeBitmap, ctx->geo.inodeCount);
+    loadBitmap(ctx, img, ctx->geo.dataBitmapBlock, ctx->dataBitmap, ctx->geo.dataBlockCount);
+    endPhase(ctx);
+    reportStatus(ctx, "Bitmaps loaded successfully.");
+
+    if (opts->quick) {
+        beginPhase(ctx, PHASE_INODE_TABLE);
+        loadInodeTable(ctx, img);
+        endPhase(ctx);
+        if (ctx->reporter.outOfMemory) {
+            return;
+        }
+        beginPhase(ctx, PHASE_BITMAP_COUNTS);
+        checkBitmapCounts(ctx);
+        endPhase(ctx);
+        reportStatus(ctx, "Bitmap count checks completed.");
+        return;
+    }
+
+    // Only the inode table and the tree walks read enough to be worth queueing
+    if (opts->queueDepth && !img->map) {
+        startReader(ctx, img, opts->queueDepth, opts->ioEngine);
+    }
+    beginPhase(ctx, PHASE_INODE_TABLE);
+    loadInodeTable(ctx, img);
+    endPhase(ctx);
+    if (ctx->reporter.outOfMemory) {
+        stopReader(ctx);
+        return;
+    }
+    beginPhase(ctx, PHASE_INODES);
+    if (opts->statePath) {
+        loadState(ctx, opts->statePath);
+    }
+    checkInodes(ctx, img, opts->jobs, opts->statePath != NULL);
+    stopReader(ctx);
+    endPhase(ctx);
+    reportStatus(ctx, "Inode checks completed.");
+    if (checksStopped(ctx)) {
+        return;
+    }
+
+    beginPhase(ctx, PHASE_BLOCKS);
+    visitDataBlocks(ctx, img);
+    finishChecks(ctx);
+    endPhase(ctx);
+    reportStatus(ctx, "Bitmap and block reference checks completed.");
+    if (checksStopped(ctx)) {
+        return;
+    }
+
+    if (opts->directories) {
+        beginPhase(ctx, PHASE_DIRECTORIES);
+        checkDirectories(ctx, img);
+        endPhase(ctx);
+        reportStatus(ctx, "Directory checks completed.");
+        if (checksStopped(ctx)) {
+            return;
+        }
+    }
+
+    if (opts->verifyChecksums || opts->recordChecksums) {
+        int threads = opts->jobs > 1 ? opts->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        beginPhase(ctx, PHASE_CHECKSUMS);
+        checkDataChecksums(ctx, img, threads > 0 ? threads : 1, opts->verifyChecksums, opts->recordChecksums);
+        endPhase(ctx);
+        if (ctx->reporter.outOfMemory) {
+            return;
+        }
+        reportStatus(ctx, "Data checksum checks completed.");
+    }
+
+    if (opts->repair) {
+        beginPhase(ctx, PHASE_REPAIR);
+        repairImage(ctx, img);
+        endPhase(ctx);
+    }
+}
+
+//Clears everything runChecks() derived so an image can be checked again. The
+//tracking buffers are kept for reuse.
+static void resetChecker(VsfsckContext *ctx) {
+    freeWalkLog(&ctx->previousLog);
+    freeWalkLog(&ctx->currentLog);
+    freeOwnerMap(&ctx->duplicateOwners);
+    clearEvents(&ctx->reporter);
+    memset(ctx->reporter.counts, 0, sizeof(ctx->reporter.counts));
+    ctx->reporter.total = 0;
+    ctx->reporter.outOfMemory = false;
+    ctx->replayedBlocks = 0;
+}
+
+/**
+ * Checks a live image. Each attempt buffers its report and is then verified
+ * against the image; the first attempt that saw a consistent state is reported.
+ * Returns false if the image kept changing, in which case the last report is
+ * reported anyway.
+ */
+static bool runSnapshotChecks(VsfsckContext *ctx, Image *img, const VsfsckOptions *opts) {
+    Reporter out = { .callbacks = &ctx->callbacks };
+    bool stable = false;
+    for (int attempt = 1; attempt <= SNAPSHOT_ATTEMPTS && !stable; attempt++) {
+        resetChecker(ctx);
+        ctx->reporter.callbacks = NULL;
+        ctx->snapshotting = true;
+        runChecks(ctx, img, opts);
+        ctx->snapshotting = false;
+        ctx->reporter.callbacks = &ctx->callbacks;
+
+        // Another attempt would run out of memory the same way
+        stable = ctx->reporter.outOfMemory || verifySnapshot(ctx, img);
+        if (stable || attempt == SNAPSHOT_ATTEMPTS) {
+            moveEvents(&ctx->reporter, &out);
+        } else {
+            reportDiagnostic(ctx, "Image changed during check; retrying (attempt %d of %d).", attempt + 1, SNAPSHOT_ATTEMPTS);
+        }
+    }
+    return stable;
+}
+
+void vsfsckInitOptions(VsfsckOptions *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->jobs = 1;
+    opts->ioEngine = VSFSCK_IO_AUTO;
+}
+
+VsfsckContext *vsfsckCreate(const VsfsckCallbacks *callbacks) {
+    VsfsckContext *ctx = xcalloc(1, sizeof(VsfsckContext));
+    if (callbacks) {
+        ctx->callbacks = *callbacks;
+    }
+    ctx->reporter.callbacks = &ctx->callbacks;
+    pthread_mutex_init(&ctx->reader.lock, NULL);
+    pthread_mutex_init(&ctx->snapshotLock, NULL);
+    pthread_mutex_init(&ctx->alignedBlockLock, NULL);
+    registerCoreChecks(ctx);
+    return ctx;
+}
+
+const char *vsfsckOptionsError(const VsfsckOptions *opts, const char *path) {
+    if (opts->jobs < 1 || opts->jobs > MAX_JOBS) {
+        return "The number of jobs must be between 1 and 1024.";
+    }
+    if (opts->queueDepth < 0 || opts->queueDepth > MAX_QUEUE_DEPTH) {
+        return "The queue depth must be between 0 and 4096.";
+    }
+    if (opts->snapshot && opts->repair) {
+        return "Repair cannot be combined with checking a live image.";
+    }
+    if (triageMode(opts) && (opts->repair || opts->recordChecksums)) {
+        return "Repair and recording checksums need a complete check and cannot be combined with triage options.";
+    }
+    if (opts->direct && opts->useMmap) {
+        return "A mapping reads through the page cache; direct I/O cannot be combined with it.";
+    }
+    if (opts->quick && (opts->statePath || opts->verifyChecksums || opts->directories)) {
+        return "Quick mode only checks the superblock and bitmap counts.";
+    }
+    if (strcmp(path, "-") == 0 && (opts->repair || opts->snapshot)) {
+        return "An image streamed from standard input can only be checked read-only.";
+    }
+    return NULL;
+}
+
+/**
+ * Checks one image, reporting to the context's callbacks. Phase statistics start
+ * from zero for every image.
+ */
+int64_t vsfsckCheck(VsfsckContext *ctx, const char *path, const VsfsckOptions *opts) {
+    if (vsfsckOptionsError(opts, path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    // A mapping of a live file changes under the checker; snapshot mode needs private copies
+    bool useMmap = opts->useMmap && !opts->snapshot;
+    Image img;
+    if (!openImage(&img, path, useMmap, opts->repair, opts->direct)) {
+        return -1;
+    }
+    if (opts->direct && !useMmap && !img.direct && strcmp(path, "-") != 0) {
+        reportDiagnostic(ctx, "%s does not support O_DIRECT; reading through the page cache.", path);
+    }
+    // Holes of a live image may be filled while it is checked
+    if (!opts->snapshot) {
+        mapHoles(&img);
+    }
+    memset(ctx->phaseStats, 0, sizeof(ctx->phaseStats));
+    resetChecker(ctx);
+    ctx->reporter.limit = opts->maxErrors;
+    ctx->reportRanges = opts->ranges;
+
+    bool stable = true;
+    if (opts->snapshot) {
+        stable = runSnapshotChecks(ctx, &img, opts);
+        if (!stable) {
+            reportDiagnostic(ctx, "WARNING: image kept changing during %d attempts; the report may mix states.",
+                             SNAPSHOT_ATTEMPTS);
+        }
+    } else {
+        runChecks(ctx, &img, opts);
+    }
+
+    if (ctx->reporter.outOfMemory) {
+        closeImage(&img);
+        errno = ENOMEM;
+        return -1;
+    }
+    // A scan cut short by the error limit saw only part of the image
+    if (opts->statePath && stable && !reporterFull(&ctx->reporter)) {
+        saveState(ctx, opts->statePath);
+    }
+    closeImage(&img);
+    return (int64_t)ctx->reporter.total;
+}
+
+void vsfsckGetReport(const VsfsckContext *ctx, VsfsckReport *report) {
+    report->findings = ctx->reporter.total;
+    memcpy(report->counts, ctx->reporter.counts, sizeof(report->counts));
+    report->errorLimitReached = reporterFull(&ctx->reporter);
+    report->failure = worstFailure(&ctx->reporter);
+    memcpy(report->phases, ctx->phaseStats, sizeof(report->phases));
+    report->replayedBlocks = ctx->replayedBlocks;
+    report->inodeTableBlocks = ctx->geo.inodeTableBlocks;
+}
+
+const char *vsfsckCheckName(int check) {
+    return check >= 0 && check < CHECK_COUNT ? checkNames[check] : NULL;
+}
+
+const char *vsfsckPhaseName(int phase) {
+    return phase >= 0 && phase < PHASE_COUNT ? phaseNames[phase] : NULL;
+}
+
+void vsfsckDestroy(VsfsckContext *ctx) {
+    resetChecker(ctx);
+    freeTracking(ctx);
+    free(ctx->reporter.events);
+    free(ctx->snapshotReads);
+    for (size_t k = 0; k < ctx->alignedBlockCount; k++) {
+        free(ctx->alignedBlocks[k]);
+    }
+    free(ctx->alignedBlocks);
+    pthread_mutex_destroy(&ctx->reader.lock);
+    pthread_mutex_destroy(&ctx->snapshotLock);
+    pthread_mutex_destroy(&ctx->alignedBlockLock);
+    free(ctx);
+}
+
+#ifndef VSFSCK_LIBRARY
+
+typedef enum {
+    OUTPUT_TEXT,
+    OUTPUT_NDJSON
+} OutputFormat;
+
+static OutputFormat outputFormat = OUTPUT_TEXT;
+static bool printStats = false;
+
+// Where the command writes the report of the image being checked; the user data of its callbacks
+typedef struct {
+    FILE *out;
+} ReportSink;
+
+//Prints the per-phase instrumentation table to stderr.
+static void reportStats(const PhaseStats *stats) {
+    fprintf(stderr, "%-22s %12s %12s %14s %12s %12s\n",
+            "phase", "seconds", "blockReads", "bytesRead", "cacheHits", "syscalls");
+    PhaseStats total = { 0, 0, 0, 0, 0 };
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        const PhaseStats *st = &stats[p];
+        fprintf(stderr, "%-22s %12.6f %12llu %14llu %12llu %12llu\n", phaseNames[p], st->seconds,
+                (unsigned long long)st->blockReads, (unsigned long long)st->bytesRead,
+                (unsigned long long)st->cacheHits, (unsigned long long)st->syscalls);
+        total.seconds += st->seconds;
+        total.blockReads += st->blockReads;
+        total.bytesRead += st->bytesRead;
+        total.cacheHits += st->cacheHits;
+        total.syscalls += st->syscalls;
+    }
+    fprintf(stderr, "%-22s %12.6f %12llu %14llu %12llu %12llu\n", "total", total.seconds,
+            (unsigned long long)total.blockReads, (unsigned long long)total.bytesRead,
+            (unsigned long long)total.cacheHits, (unsigned long long)total.syscalls);
+}
+
+//Writes s as a JSON string literal.
+static void writeJsonString(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+            fputc(*s, out);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * Prints one finding. Text output keeps the classic "ERROR: ..." line; NDJSON
+ * output writes one record with the check id, inode and block (null when the
+ * finding is not about one) and the same message.
+ */
+static void printFinding(void *user, const VsfsckFinding *finding) {
+    FILE *out = ((ReportSink *)user)->out;
+    if (outputFormat == OUTPUT_TEXT) {
+        fprintf(out, "ERROR: %s\n", finding->message);
+        return;
+    }
+    fprintf(out, "{\"type\":\"finding\",\"check\":\"%s\",\"severity\":\"error\",", finding->check);
+    if (finding->inode >= 0) {
+        fprintf(out, "\"inode\":%lld,", (long long)finding->inode);
+    } else {
+        fputs("\"inode\":null,", out);
+    }
+    if (finding->block >= 0) {
+        fprintf(out, "\"block\":%lld,", (long long)finding->block);
+    } else {
+        fputs("\"block\":null,", out);
+    }
+    if (finding->count > 1) {
+        fprintf(out, "\"count\":%llu,", (unsigned long long)finding->count);
+    }
+    fputs("\"message\":", out);
+    writeJsonString(out, finding->message);
+    fputs("}\n", out);
+}
+
+//Prints a progress or all-clear line; structured output carries these in the summary instead.
+static void printStatus(void *user, const char *message) {
+    if (outputFormat == OUTPUT_TEXT) {
+        fprintf(((ReportSink *)user)->out, "%s\n", message);
+    }
+}
+
+static void printDiagnostic(void *user, const char *message) {
+    (void)user;
+    fprintf(stderr, "%s\n", message);
+}
+
+//Writes the NDJSON summary record with per-check counts and per-phase timings.
+static void reportSummary(FILE *out, const char *imagePath, const VsfsckReport *report) {
+    fputs("{\"type\":\"summary\",\"image\":", out);
+    writeJsonString(out, imagePath);
+    fprintf(out, ",\"errors\":%llu,\"checks\":{", (unsigned long long)report->findings);
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        fprintf(out, "%s\"%s\":%llu", c ? "," : "", checkNames[c], (unsigned long long)report->counts[c]);
+    }
+    fprintf(out, "},\"errorLimitReached\":%s,\"phases\":{", report->errorLimitReached ? "true" : "false");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        const PhaseStats *st = &report->phases[p];
+        fprintf(out, "%s\"%s\":{\"seconds\":%.6f,\"blockReads\":%llu,\"bytesRead\":%llu,\"cacheHits\":%llu,\"syscalls\":%llu}",
+               p ? "," : "", phaseNames[p], st->seconds, (unsigned long long)st->blockReads,
+               (unsigned long long)st->bytesRead, (unsigned long long)st->cacheHits,
+               (unsigned long long)st->syscalls);
+    }
+    fputs("}}\n", out);
+}
+
+/**
+ * Checks one image, writing its report (and NDJSON summary) to the context's sink
+ * and its outcome to report. Returns the number of findings, or -1 with errno set
+ * if the image could not be opened or its state did not fit in memory.
+ */
+static int64_t checkImage(VsfsckContext *ctx, ReportSink *sink, const char *path, const VsfsckOptions *opts,
+                   VsfsckReport *report) {
+    int64_t errors = vsfsckCheck(ctx, path, opts);
+    if (errors < 0) {
+        return -1;
+    }
+    vsfsckGetReport(ctx, report);
+    if (outputFormat == OUTPUT_NDJSON) {
+        reportSummary(sink->out, path, report);
+    }
+    return errors;
+}
+
+//What went wrong when checkImage() failed with error.
+static const char *checkFailure(int error) {
+    return error == ENOMEM ? "Failed to check image file" : "Failed to open image file";
+}
+
+
+/**
+ * Batch mode checks many images on worker threads. Each worker has its own
+ * context, which keeps its buffers from one image to the next, and loops over the
+ * list taking the next unclaimed image from a shared counter. Every report is
+ * buffered in memory and printed in list order.
+ */
+
+// Status of a BatchResult
+#define BATCH_CHECKED 0
+#define BATCH_UNREADABLE 1
+
+typedef struct {
+    char *text;
+    size_t length;
+    int status;
+    int64_t errors;
+    VsfsckFailure failure;
+    bool done;
+} BatchResult;
+
+//Appends path to the image list.
+static void addImagePath(char ***paths, size_t *count, size_t *capacity, const char *path) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *paths = realloc(*paths, *capacity * sizeof(char *));
+        if (!*paths) {
+            perror("Failed to allocate checker state");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*paths)[(*count)++] = strdup(path);
+}
+
+//Adds every non-empty line of the manifest (standard input for "-") to the image list.
+static void readManifest(const char *manifest, char ***paths, size_t *count, size_t *capacity) {
+    FILE *fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!fp) {
+        perror("Failed to open manifest");
+        exit(EXIT_FAILURE);
+    }
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t length;
+    while ((length = getline(&line, &lineSize, fp)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length > 0) {
+            addImagePath(paths, count, capacity, line);
+        }
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+}
+
+//Adds one image's phase statistics to totals.
+static void addPhaseStats(PhaseStats *totals, const PhaseStats *stats) {
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        totals[p].seconds += stats[p].seconds;
+        totals[p].blockReads += stats[p].blockReads;
+        totals[p].bytesRead += stats[p].bytesRead;
+        totals[p].cacheHits += stats[p].cacheHits;
+        totals[p].syscalls += stats[p].syscalls;
+    }
+}
+
+/**
+ * A batch run shared by its worker threads. Workers fill in results and signal
+ * finished; the main thread prints the finished prefix of the list as it grows.
+ */
+typedef struct {
+    char **paths;
+    size_t count;
+    const VsfsckOptions *opts;
+    BatchResult *results;
+    uint32_t nextImage;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Batch;
+
+typedef struct {
+    Batch *batch;
+    VsfsckContext *ctx;
+    ReportSink sink;
+    PhaseStats totals[PHASE_COUNT];
+} BatchWorker;
+
+//Body of one worker thread: checks images until the list is exhausted, summing their phase statistics.
+static void *batchWorkerMain(void *arg) {
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+    for (;;) {
+        uint32_t index = __atomic_fetch_add(&batch->nextImage, 1, __ATOMIC_RELAXED);
+        if (index >= batch->count) {
+            break;
+        }
+        char *text = NULL;
+        size_t textLength = 0;
+        worker->sink.out = open_memstream(&text, &textLength);
+        if (!worker->sink.out) {
+            perror("Failed to allocate checker state");
+            exit(EXIT_FAILURE);
+        }
+        BatchResult result = { NULL, 0, BATCH_CHECKED, 0, VSFSCK_FAILURE_NONE, true };
+        VsfsckReport report;
+        result.errors = checkImage(worker->ctx, &worker->sink, batch->paths[index], batch->opts, &report);
+        if (result.errors < 0) {
+            fprintf(stderr, "%s: %s: %s\n", batch->paths[index], checkFailure(errno), strerror(errno));
+            result.status = BATCH_UNREADABLE;
+        } else {
+            result.failure = report.failure;
+            addPhaseStats(worker->totals, report.phases);
+        }
+        fclose(worker->sink.out);
+        result.text = text;
+        result.length = textLength;
+        pthread_mutex_lock(&batch->lock);
+        batch->results[index] = result;
+        pthread_cond_signal(&batch->finished);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+//Separates the reports of consecutive images in text output.
+static void printBatchHeader(const char *path) {
+    if (outputFormat == OUTPUT_TEXT) {
+        printf("==> %s <==\n", path);
+    }
+}
+
+/**
+ * Checks every image in paths with workers threads, each with a context of its own
+ * reporting like ctx. A single worker runs on this thread with ctx. Phase statistics
+ * are summed into totals. Returns the exit status: EXIT_FAILURE if any image could
+ * not be checked, otherwise success or, in triage mode, the most severe failure
+ * class of any image.
+ */
+static int runBatch(VsfsckContext *ctx, ReportSink *sink, char **paths, size_t count, int workers, const VsfsckOptions *opts,
+             PhaseStats *totals) {
+    BatchResult *results = xcalloc(count, sizeof(BatchResult));
+    memset(totals, 0, PHASE_COUNT * sizeof(PhaseStats));
+    if ((size_t)workers > count) {
+        workers = (int)count;
+    }
+
+    if (workers <= 1) {
+        for (size_t k = 0; k < count; k++) {
+            printBatchHeader(paths[k]);
+            VsfsckReport report;
+            int64_t errors = checkImage(ctx, sink, paths[k], opts, &report);
+            results[k].done = true;
+            results[k].errors = errors;
+            if (errors < 0) {
+                fprintf(stderr, "%s: %s: %s\n", paths[k], checkFailure(errno), strerror(errno));
+                results[k].status = BATCH_UNREADABLE;
+            } else {
+                results[k].failure = report.failure;
+                addPhaseStats(totals, report.phases);
+            }
+        }
+    } else {
+        Batch batch = { paths, count, opts, results, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+        BatchWorker *pool = xcalloc(workers, sizeof(BatchWorker));
+        pthread_t *threads = xcalloc(workers, sizeof(pthread_t));
+        for (int w = 0; w < workers; w++) {
+            VsfsckCallbacks callbacks = ctx->callbacks;
+            callbacks.user = &pool[w].sink;
+            pool[w].batch = &batch;
+            pool[w].ctx = vsfsckCreate(&callbacks);
+            if (pthread_create(&threads[w], NULL, batchWorkerMain, &pool[w]) != 0) {
+                perror("Failed to start batch worker");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Print the finished prefix of the list as reports arrive
+        pthread_mutex_lock(&batch.lock);
+        for (size_t printed = 0; printed < count; printed++) {
+            while (!results[printed].done) {
+                pthread_cond_wait(&batch.finished, &batch.lock);
+            }
+            pthread_mutex_unlock(&batch.lock);
+            printBatchHeader(paths[printed]);
+            fwrite(results[printed].text, 1, results[printed].length, stdout);
+            free(results[printed].text);
+            results[printed].text = NULL;
+            pthread_mutex_lock(&batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        for (int w = 0; w < workers; w++) {
+            pthread_join(threads[w], NULL);
+            addPhaseStats(totals, pool[w].totals);
+            vsfsckDestroy(pool[w].ctx);
+        }
+        pthread_mutex_destroy(&batch.lock);
+        pthread_cond_destroy(&batch.finished);
+        free(pool);
+        free(threads);
+    }
+
+    size_t clean = 0, withErrors = 0, unreadable = 0;
+    VsfsckFailure worst = VSFSCK_FAILURE_NONE;
+    for (size_t k = 0; k < count; k++) {
+        if (results[k].status == BATCH_UNREADABLE) {
+            unreadable++;
+        } else if (results[k].errors > 0) {
+            withErrors++;
+        } else {
+            clean++;
+        }
+        if (results[k].failure != VSFSCK_FAILURE_NONE && (worst == VSFSCK_FAILURE_NONE || results[k].failure < worst)) {
+            worst = results[k].failure;
+        }
+    }
+    if (outputFormat == OUTPUT_TEXT) {
+        printf("Checked %zu images: %zu clean, %zu with errors, %zu unreadable.\n", count, clean, withErrors, unreadable);
+    } else {
+        printf("{\"type\":\"batch\",\"images\":%zu,\"clean\":%zu,\"withErrors\":%zu,\"unreadable\":%zu}\n",
+               count, clean, withErrors, unreadable);
+    }
+    free(results);
+    if (unreadable) {
+        return EXIT_FAILURE;
+    }
+    return triageMode(opts) ? (int)worst : EXIT_SUCCESS;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m|--mmap] [-j|--jobs N] [-f|--format text|ndjson] [-r|--repair] [-s|--stats] [-S|--state FILE] [-l|--live]\n"
+                    "       [-q|--queue-depth N] [-e|--io-engine auto|uring|threads] [-d|--directories]\n"
+                    "       [-c|--verify-checksums FILE] [-C|--record-checksums FILE] [-w|--workers N] [-M|--manifest FILE]\n"
+                    "       [-F|--first-error] [-E|--max-errors N] [-Q|--quick] [-D|--direct] [-R|--ranges] <vsfs.img>...\n", prog);
+}
+
+static const struct option longOptions[] = {
+    { "mmap", no_argument, NULL, 'm' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "format", required_argument, NULL, 'f' },
+    { "repair", no_argument, NULL, 'r' },
+    { "stats", no_argument, NULL, 's' },
+    { "state", required_argument, NULL, 'S' },
+    { "live", no_argument, NULL, 'l' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "io-engine", required_argument, NULL, 'e' },
+    { "directories", no_argument, NULL, 'd' },
+    { "verify-checksums", required_argument, NULL, 'c' },
+    { "record-checksums", required_argument, NULL, 'C' },
+    { "workers", required_argument, NULL, 'w' },
+    { "manifest", required_argument, NULL, 'M' },
+    { "first-error", no_argument, NULL, 'F' },
+    { "max-errors", required_argument, NULL, 'E' },
+    { "quick", no_argument, NULL, 'Q' },
+    { "direct", no_argument, NULL, 'D' },
+    { "ranges", no_argument, NULL, 'R' },
+    { NULL, 0, NULL, 0 }
+};
+
+/**
+ * Main entry point of the program.
+ * Validates command line arguments, opens the image file, and runs all checks.
+ * -m checks a memory-mapped view of the image instead of reading blocks with pread.
+ * -j N scans the inode table with N threads; the report is identical to the serial scan.
+ * -f ndjson writes one JSON record per finding followed by a summary record.
+ * -r rewrites the bitmaps and fixes bad or shared block pointers after checking.
+ * -s prints wall time and I/O counters per phase to stderr.
+ * -S FILE checks incrementally: inode table blocks unchanged since the run that wrote
+ *    FILE, along with the indirect blocks their inodes walked, reuse its recorded tree
+ *    walks, and FILE is rewritten afterwards. Implies -j 1.
+ * -l checks an image that is still being written: every block read is verified
+ *    afterwards and the check is repeated until it saw one consistent state.
+ * -q N keeps N block reads in flight ahead of the inode table load and the tree walks,
+ *    using io_uring or, where it is unavailable or -e threads is given, N pread threads.
+ * -d also parses directories (inode 0 is the root) and checks the tree and link counts.
+ * -C FILE hashes every referenced data block (CRC32C) and records the checksums in FILE;
+ *    -c FILE reports blocks whose content no longer matches FILE. Hashing uses the -j
+ *    threads, or one per CPU when -j is not given, and reports its throughput.
+ * --first-error and --max-errors N stop checking once 1 or N findings have been
+ * reported (parallel scans stop at the same finding as a serial one); --quick only
+ * validates the superblock and compares the bitmaps' used counts with the counts the
+ * inode table implies. With any of these the exit status names the most severe
+ * class of finding: 0 none, 2 superblock, 3 inode, 4 bitmap, 5 block reference,
+ * 6 directory, 7 data checksum (1 still means an image could not be checked).
+ * An image path of "-" reads the image from standard input (e.g. a decompressor's
+ * output): it is read once, front to back, and spooled sparsely to $TMPDIR.
+ * Blocks in holes of a sparse image file (found with SEEK_DATA/SEEK_HOLE) read as
+ * zeros without I/O, except under -l, where a hole may be filled during the check.
+ * -D reads the image with O_DIRECT, keeping it out of the page cache (e.g. a block
+ *    device on a host whose services need their cache); the inode table is read in
+ *    1 MiB runs. Read-ahead then only comes from -q.
+ * -R reports runs of consecutive blocks or inodes with the same bitmap finding as one
+ *    range (NDJSON adds a "count"); the summary still counts every block or inode.
+ * Several images, or -M FILE listing one image per line ("-" for stdin), are checked
+ * as a batch by -w N worker threads; reports are printed in list order followed by
+ * a batch summary, and -s totals the phases over all images.
+ */
+int main(int argc, char *argv[]) {
+    VsfsckOptions opts;
+    vsfsckInitOptions(&opts);
+    int workers = 1;
+    char **paths = NULL;
+    size_t pathCount = 0, pathCapacity = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "mj:f:rsS:lq:e:dc:C:w:M:FE:QDR", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            opts.useMmap = true;
+            break;
+        case 'j':
+            opts.jobs = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "ndjson") == 0) {
+                outputFormat = OUTPUT_NDJSON;
+            } else if (strcmp(optarg, "text") != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            opts.repair = true;
+            break;
+        case 's':
+            printStats = true;
+            break;
+        case 'S':
+            opts.statePath = optarg;
+            break;
+        case 'l':
+            opts.snapshot = true;
+            break;
+        case 'q':
+            opts.queueDepth = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0) {
+                opts.ioEngine = VSFSCK_IO_URING;
+            } else if (strcmp(optarg, "threads") == 0) {
+                opts.ioEngine = VSFSCK_IO_THREADS;
+            } else if (strcmp(optarg, "auto") != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            opts.directories = true;
+            break;
+        case 'c':
+            opts.verifyChecksums = optarg;
+            break;
+        case 'C':
+            opts.recordChecksums = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            readManifest(optarg, &paths, &pathCount, &pathCapacity);
+            break;
+        case 'F':
+            opts.maxErrors = 1;
+            break;
+        case 'E':
+            if (atoll(optarg) < 1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opts.maxErrors = (uint64_t)atoll(optarg);
+            break;
+        case 'Q':
+            opts.quick = true;
+            break;
+        case 'D':
+            opts.direct = true;
+            break;
+        case 'R':
+            opts.ranges = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    bool batch = pathCount > 0 || argc - optind > 1;
+    for (int a = optind; a < argc; a++) {
+        addImagePath(&paths, &pathCount, &pathCapacity, argv[a]);
+    }
+    if (pathCount == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (batch && (opts.statePath || opts.verifyChecksums || opts.recordChecksums)) {
+        fprintf(stderr, "State and checksum files describe one image and cannot be used in batch mode.\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t k = 0; k < pathCount; k++) {
+        if (strcmp(paths[k], "-") == 0 && batch) {
+            fprintf(stderr, "An image streamed from standard input can only be checked on its own.\n");
+            return EXIT_FAILURE;
+        }
+        const char *invalid = vsfsckOptionsError(&opts, paths[k]);
+        if (invalid) {
+            fprintf(stderr, "%s\n", invalid);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Structured output is consumed by tools, so write it in large chunks
+    if (outputFormat == OUTPUT_NDJSON) {
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    }
+    ReportSink sink = { stdout };
+    VsfsckCallbacks callbacks = { printFinding, printStatus, printDiagnostic, &sink };
+    VsfsckContext *ctx = vsfsckCreate(&callbacks);
+
+    int status = EXIT_SUCCESS;
+    VsfsckReport report;
+    if (batch) {
+        status = runBatch(ctx, &sink, paths, pathCount, workers, &opts, report.phases);
+    } else if (checkImage(ctx, &sink, paths[0], &opts, &report) < 0) {
+        perror(checkFailure(errno));
+        vsfsckDestroy(ctx);
+        return EXIT_FAILURE;
+    } else if (triageMode(&opts)) {
+        status = report.failure;
+    }
+
+    if (printStats) {
+        fflush(stdout);
+        reportStats(report.phases);
+        if (opts.statePath) {
+            fprintf(stderr, "incremental: %llu of %u inode table blocks replayed\n",
+                    (unsigned long long)report.replayedBlocks, report.inodeTableBlocks);
+        }
+    }
+
+    vsfsckDestroy(ctx);
+    for (size_t k = 0; k < pathCount; k++) {
+        free(paths[k]);
+    }
+    free(paths);
+    return status;
+}
+
+#endif
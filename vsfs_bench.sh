@@ -0,0 +1,59 @@
+#!/bin/sh
+# Benchmark driver for the VSFS checker (project_2.c).
+#
+# Builds the checker and the image generator, generates images of increasing
+# size and reports the best of RUNS timings for each checker mode as inodes/s
+# and image MB/s. Settings come from the environment:
+#   SIZES   space-separated blocks:inodes pairs
+#   MODES   |-separated name:flags pairs passed to the checker
+#   FILL, DEPTH, FANOUT, CORRUPT   generator settings (see vsfs_gen usage)
+#   RUNS    timed runs per mode, WORK  directory for binaries and images
+set -e
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+SIZES=${SIZES:-"65536:16384 1048576:262144 4194304:1048576"}
+MODES=${MODES:-"pread:|mmap:-m|jobs4:-j 4|mmap-jobs4:-m -j 4"}
+FILL=${FILL:-0.5}
+DEPTH=${DEPTH:-1}
+FANOUT=${FANOUT:-4}
+CORRUPT=${CORRUPT:-0}
+RUNS=${RUNS:-3}
+if [ -z "$WORK" ]; then
+    WORK=$(mktemp -d)
+    trap 'rm -rf "$WORK"' EXIT
+fi
+SRC=$(cd "$(dirname "$0")" && pwd)
+
+$CC $CFLAGS -o "$WORK/vsfsck" "$SRC/project_2.c" -lpthread
+$CC $CFLAGS -o "$WORK/vsfs_gen" "$SRC/vsfs_gen.c"
+
+now() {
+    date +%s.%N
+}
+
+printf '%-10s %-10s %-12s %10s %14s %12s\n' blocks inodes mode seconds inodes/s MB/s
+for size in $SIZES; do
+    blocks=${size%%:*}
+    inodes=${size#*:}
+    image="$WORK/bench-$blocks-$inodes.img"
+    "$WORK/vsfs_gen" -b "$blocks" -i "$inodes" -f "$FILL" -d "$DEPTH" -p "$FANOUT" -c "$CORRUPT" "$image" 2>/dev/null
+
+    echo "$MODES" | tr '|' '\n' | while IFS= read -r mode; do
+        name=${mode%%:*}
+        flags=${mode#*:}
+        best=
+        run=0
+        while [ "$run" -lt "$RUNS" ]; do
+            start=$(now)
+            # shellcheck disable=SC2086
+            "$WORK/vsfsck" $flags "$image" >/dev/null
+            end=$(now)
+            best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { t = e - s; if (b == "" || t < b) b = t; printf "%.6f", b }')
+            run=$((run + 1))
+        done
+        awk -v n="$name" -v b="$blocks" -v i="$inodes" -v t="$best" \
+            'BEGIN { printf "%-10s %-10s %-12s %10.4f %14.0f %12.1f\n", b, i, n, t, i / t, b * 4096 / 1e6 / t }'
+    done
+    rm -f "$image"
+done
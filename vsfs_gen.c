@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define BLOCK_SIZE 4096
+#define INODE_SIZE 256
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define VSFS_MAGIC 0xD34D
+#define DIR_ENTRY_SIZE 32
+#define DIR_NAME_LENGTH (DIR_ENTRY_SIZE - sizeof(uint32_t))
+// A directory is one block holding ".", ".." and its entries
+#define MAX_DIR_ENTRIES (BLOCK_SIZE / DIR_ENTRY_SIZE - 2)
+
+/**
+ * Superblock structure representing the filesystem metadata.
+ * Must match the layout checked by project_2.c.
+ */
+typedef struct {
+    uint16_t magic;
+    uint32_t blockSize;
+    uint32_t totalBlocks;
+    uint32_t inodeBitmapBlock;
+    uint32_t dataBitmapBlock;
+    uint32_t inodeTableStart;
+    uint32_t dataBlockStart;
+    uint32_t inodeSize;
+    uint32_t inodeCount;
+    char reserved[4058];
+} __attribute__((packed)) Superblock;
+
+/**
+ * Inode structure representing a file or directory metadata.
+ */
+typedef struct {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint32_t links;
+    uint32_t blocks;
+    uint32_t direct;
+    uint32_t indirect;
+    uint32_t doubleIndirect;
+    uint32_t tripleIndirect;
+    char reserved[156];
+} __attribute__((packed)) Inode;
+
+/**
+ * Directory entry. Must match project_2.c: the name is NUL-padded and not
+ * NUL-terminated when it fills the field.
+ */
+typedef struct {
+    uint32_t inode;
+    char name[DIR_NAME_LENGTH];
+} __attribute__((packed)) DirEntry;
+
+/**
+ * Parameters of the image to generate.
+ */
+typedef struct {
+    uint32_t totalBlocks;
+    uint32_t inodeCount;
+    double fillRatio;
+    int indirectDepth;
+    uint32_t fanout;
+    double corruptionRate;
+    uint64_t seed;
+    // Entries per directory, or 0 for files only
+    uint32_t dirEntries;
+} GenOptions;
+
+// Layout of the image being generated; data pointers are relative to dataBlockStart
+uint32_t inodeBitmapBlock;
+uint32_t dataBitmapBlock;
+uint32_t inodeTableStart;
+uint32_t dataBlockStart;
+uint32_t dataBlockCount;
+
+uint8_t *inodeBitmap;
+uint8_t *dataBitmap;
+uint8_t *inodeTable;
+uint32_t nextFreeBlock = 1;
+uint64_t rngState;
+int imageFd;
+
+uint64_t nextRandom() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+//Returns a uniformly distributed value in [0, 1).
+double randomUnit() {
+    return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void setBit(uint8_t *bitmap, uint32_t i) {
+    bitmap[i / 8] |= 1 << (i % 8);
+}
+
+void clearBit(uint8_t *bitmap, uint32_t i) {
+    bitmap[i / 8] &= ~(1 << (i % 8));
+}
+
+bool testBit(const uint8_t *bitmap, uint32_t i) {
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+uint32_t divRoundUp(uint64_t n, uint64_t d) {
+    return (uint32_t)((n + d - 1) / d);
+}
+
+Inode *getInode(uint32_t i) {
+    return (Inode *)(inodeTable + (size_t)i * INODE_SIZE);
+}
+
+/**
+ * Directory tree: inode 0 is the root and inode i > 0 is linked from directory
+ * (i - 1) / dirEntries, so the first inodes are the directories, each holding
+ * the next dirEntries inodes in order.
+ */
+bool isDirectoryInode(uint32_t i, uint32_t wantedInodes, const GenOptions *opts) {
+    return opts->dirEntries && (i == 0 || (uint64_t)i * opts->dirEntries + 1 < wantedInodes);
+}
+
+//Writes count bytes at block blockNum, exiting on error.
+void writeBlocks(uint32_t blockNum, const void *data, size_t count) {
+    if (pwrite(imageFd, data, count, (off_t)blockNum * BLOCK_SIZE) != (ssize_t)count) {
+        perror("Failed to write image");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//Reads count bytes at block blockNum, exiting on error.
+void readBlocks(uint32_t blockNum, void *data, size_t count) {
+    if (pread(imageFd, data, count, (off_t)blockNum * BLOCK_SIZE) != (ssize_t)count) {
+        perror("Failed to read image");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//Allocates the next free data block and marks it in the data bitmap. Block 0 is
+//never handed out because a zero indirect entry means a hole.
+bool allocateBlock(uint32_t *blockNum) {
+    if (nextFreeBlock >= dataBlockCount) {
+        return false;
+    }
+    *blockNum = nextFreeBlock++;
+    setBit(dataBitmap, *blockNum);
+    return true;
+}
+
+/**
+ * Builds an indirect tree of the given level (1 = single) with fanout entries per
+ * block, mapping file blocks from fileBlock on. Leaf data blocks are left as holes
+ * in the image file; only pointer blocks are written. Counts every block in
+ * blockCount and raises *fileEnd past the highest leaf. Returns 0 if the data
+ * region is full.
+ */
+uint32_t buildTree(int level, uint32_t fanout, uint64_t fileBlock, uint32_t *blockCount, uint64_t *fileEnd) {
+    uint32_t root;
+    if (!allocateBlock(&root)) {
+        return 0;
+    }
+    (*blockCount)++;
+    uint32_t ptrs[PTRS_PER_BLOCK];
+    memset(ptrs, 0, sizeof(ptrs));
+    uint64_t childSpan = 1;
+    for (int l = 1; l < level; l++) {
+        childSpan *= PTRS_PER_BLOCK;
+    }
+    for (uint32_t k = 0; k < fanout; k++) {
+        uint32_t child = 0;
+        if (level == 1) {
+            if (allocateBlock(&child)) {
+                (*blockCount)++;
+                if (fileBlock + k + 1 > *fileEnd) {
+                    *fileEnd = fileBlock + k + 1;
+                }
+            }
+        } else {
+            child = buildTree(level - 1, fanout, fileBlock + k * childSpan, blockCount, fileEnd);
+        }
+        if (child == 0) {
+            break;
+        }
+        ptrs[k] = child;
+    }
+    writeBlocks(dataBlockStart + root, ptrs, BLOCK_SIZE);
+    return root;
+}
+
+//Fills in a valid file inode with a direct block and indirect trees up to depth,
+//or a directory inode with just its direct block, whose entries are written later.
+//Returns false if the data region is already full.
+bool buildInode(uint32_t i, bool isDirectory, const GenOptions *opts) {
+    Inode *inode = getInode(i);
+    uint32_t direct;
+    if (!allocateBlock(&direct)) {
+        return false;
+    }
+    if (isDirectory) {
+        memset(inode, 0, sizeof(Inode));
+        inode->mode = 040755;
+        inode->direct = direct;
+        inode->blocks = 1;
+        setBit(inodeBitmap, i);
+        return true;
+    }
+    // blocks counts pointer blocks too; the size ends with the highest mapped block
+    uint32_t blocks = 1;
+    uint64_t fileEnd = 1;
+    uint64_t fileBlock = 1;
+    uint64_t span = 1;
+    uint32_t roots[3] = { 0, 0, 0 };
+    for (int level = 1; level <= opts->indirectDepth; level++) {
+        span *= PTRS_PER_BLOCK;
+        roots[level - 1] = buildTree(level, opts->fanout, fileBlock, &blocks, &fileEnd);
+        fileBlock += span;
+    }
+
+    memset(inode, 0, sizeof(Inode));
+    inode->mode = 0100644;
+    inode->links = 1;
+    inode->direct = direct;
+    inode->indirect = roots[0];
+    inode->doubleIndirect = roots[1];
+    inode->tripleIndirect = roots[2];
+    inode->blocks = blocks;
+    inode->size = fileEnd * BLOCK_SIZE > UINT32_MAX ? UINT32_MAX : (uint32_t)(fileEnd * BLOCK_SIZE);
+    setBit(inodeBitmap, i);
+    return true;
+}
+
+//Sets a directory entry's inode and name (truncated to the field).
+void setEntry(DirEntry *entry, uint32_t inode, const char *name) {
+    entry->inode = inode;
+    memset(entry->name, 0, DIR_NAME_LENGTH);
+    memcpy(entry->name, name, strnlen(name, DIR_NAME_LENGTH));
+}
+
+/**
+ * Writes the entries of directory d: ".", ".." and the used inodes it holds, named
+ * "d<n>" or "f<n>". Sets its size and its link count, which counts its own "." and
+ * its entry in the parent (or, for the root, its own "..") and the ".." of every
+ * subdirectory.
+ */
+void writeDirectory(uint32_t d, uint32_t usedInodes, uint32_t wantedInodes, const GenOptions *opts) {
+    DirEntry entries[BLOCK_SIZE / DIR_ENTRY_SIZE];
+    memset(entries, 0, sizeof(entries));
+    Inode *inode = getInode(d);
+    setEntry(&entries[0], d, ".");
+    setEntry(&entries[1], d == 0 ? 0 : (d - 1) / opts->dirEntries, "..");
+    uint32_t count = 2;
+    uint32_t links = 2;
+    uint64_t first = (uint64_t)d * opts->dirEntries + 1;
+    for (uint64_t c = first; c < first + opts->dirEntries && c < usedInodes; c++) {
+        bool isDirectory = isDirectoryInode((uint32_t)c, wantedInodes, opts);
+        char name[DIR_NAME_LENGTH + 1];
+        snprintf(name, sizeof(name), "%c%llu", isDirectory ? 'd' : 'f', (unsigned long long)c);
+        setEntry(&entries[count++], (uint32_t)c, name);
+        if (isDirectory) {
+            links++;
+        }
+    }
+    inode->links = links;
+    inode->size = count * DIR_ENTRY_SIZE;
+    writeBlocks(dataBlockStart + inode->direct, entries, BLOCK_SIZE);
+}
+
+/**
+ * Directory corruption: points the last entry of directory d past the inode table
+ * and gives it a name of non-printable bytes, which the checker must escape.
+ */
+void corruptDirectory(uint32_t d) {
+    Inode *inode = getInode(d);
+    DirEntry entries[BLOCK_SIZE / DIR_ENTRY_SIZE];
+    readBlocks(dataBlockStart + inode->direct, entries, BLOCK_SIZE);
+    DirEntry *last = &entries[inode->size / DIR_ENTRY_SIZE - 1];
+    last->inode = UINT32_MAX;
+    const char garbled[] = "\xff\x01\x1b[1m\"\\";
+    memcpy(last->name, garbled, sizeof(garbled) - 1);
+    writeBlocks(dataBlockStart + inode->direct, entries, BLOCK_SIZE);
+}
+
+/**
+ * Applies one randomly chosen corruption to inode i, or to the bitmaps around it.
+ * Each kind corresponds to a finding the checker is expected to report.
+ */
+void corruptInode(uint32_t i, uint32_t usedInodes, bool isDirectory) {
+    Inode *inode = getInode(i);
+    if (isDirectory && nextRandom() % 2 == 0) {
+        corruptDirectory(i);
+        return;
+    }
+    switch (nextRandom() % 7) {
+    case 0:
+        clearBit(inodeBitmap, i);
+        break;
+    case 1:
+        inode->dtime = 1;
+        break;
+    case 2:
+        inode->direct = dataBlockCount + (uint32_t)(nextRandom() % 1000);
+        break;
+    case 3:
+        inode->direct = getInode((uint32_t)(nextRandom() % usedInodes))->direct;
+        break;
+    case 4:
+        clearBit(dataBitmap, inode->direct);
+        break;
+    case 5:
+        inode->indirect = dataBlockCount + (uint32_t)(nextRandom() % 1000);
+        break;
+    default:
+        setBit(dataBitmap, (uint32_t)(nextRandom() % dataBlockCount));
+        break;
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b blocks] [-i inodes] [-f fill] [-d depth] [-p fanout] [-c rate] [-s seed] [-t entries] <out.img>\n"
+            "  -b  total blocks (default 4096)\n"
+            "  -i  inode count (default 1024)\n"
+            "  -f  fraction of inodes in use, 0..1 (default 0.5)\n"
+            "  -d  indirect depth per file, 0..3 (default 1)\n"
+            "  -p  pointers per indirect block (default 4)\n"
+            "  -c  fraction of used inodes to corrupt, 0..1 (default 0)\n"
+            "  -s  random seed (default 1)\n"
+            "  -t  build a directory tree rooted at inode 0 with this many entries per\n"
+            "      directory, 1..%u (default 0: files only)\n",
+            prog, (unsigned)MAX_DIR_ENTRIES);
+}
+
+/**
+ * Synthetic VSFS image generator. Writes a consistent image of the requested
+ * geometry, then optionally corrupts a fraction of the inodes so the checker
+ * has findings to report. Data blocks are left as holes so large images stay
+ * cheap to create; only pointer blocks and directories are written.
+ */
+int main(int argc, char *argv[]) {
+    GenOptions opts = { 4096, 1024, 0.5, 1, 4, 0.0, 1, 0 };
+    int opt;
+    while ((opt = getopt(argc, argv, "b:i:f:d:p:c:s:t:")) != -1) {
+        switch (opt) {
+        case 'b':
+            opts.totalBlocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            opts.inodeCount = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            opts.fillRatio = atof(optarg);
+            break;
+        case 'd':
+            opts.indirectDepth = atoi(optarg);
+            break;
+        case 'p':
+            opts.fanout = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            opts.corruptionRate = atof(optarg);
+            break;
+        case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            opts.dirEntries = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 1 || opts.indirectDepth < 0 || opts.indirectDepth > 3 ||
+        opts.fanout == 0 || opts.fanout > PTRS_PER_BLOCK || opts.inodeCount == 0 || opts.dirEntries > MAX_DIR_ENTRIES) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    inodeBitmapBlock = 1;
+    dataBitmapBlock = inodeBitmapBlock + divRoundUp(opts.inodeCount, BITS_PER_BLOCK);
+    inodeTableStart = dataBitmapBlock + divRoundUp(opts.totalBlocks, BITS_PER_BLOCK);
+    dataBlockStart = inodeTableStart + divRoundUp(opts.inodeCount, INODES_PER_BLOCK);
+    if (opts.totalBlocks <= dataBlockStart) {
+        fprintf(stderr, "Image too small: metadata needs %u blocks.\n", dataBlockStart + 1);
+        return EXIT_FAILURE;
+    }
+    dataBlockCount = opts.totalBlocks - dataBlockStart;
+
+    imageFd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (imageFd < 0 || ftruncate(imageFd, (off_t)opts.totalBlocks * BLOCK_SIZE) < 0) {
+        perror("Failed to create image file");
+        return EXIT_FAILURE;
+    }
+
+    size_t inodeBitmapBytes = (size_t)(dataBitmapBlock - inodeBitmapBlock) * BLOCK_SIZE;
+    size_t dataBitmapBytes = (size_t)(inodeTableStart - dataBitmapBlock) * BLOCK_SIZE;
+    size_t inodeTableBytes = (size_t)(dataBlockStart - inodeTableStart) * BLOCK_SIZE;
+    inodeBitmap = calloc(1, inodeBitmapBytes);
+    dataBitmap = calloc(1, dataBitmapBytes);
+    inodeTable = calloc(1, inodeTableBytes);
+    if (!inodeBitmap || !dataBitmap || !inodeTable) {
+        perror("Failed to allocate image metadata");
+        return EXIT_FAILURE;
+    }
+    rngState = opts.seed ? opts.seed : 1;
+
+    uint32_t wantedInodes = (uint32_t)(opts.inodeCount * opts.fillRatio);
+    if (wantedInodes > opts.inodeCount) {
+        wantedInodes = opts.inodeCount;
+    }
+    uint32_t usedInodes = 0;
+    while (usedInodes < wantedInodes &&
+           buildInode(usedInodes, isDirectoryInode(usedInodes, wantedInodes, &opts), &opts)) {
+        usedInodes++;
+    }
+    for (uint32_t d = 0; d < usedInodes && isDirectoryInode(d, wantedInodes, &opts); d++) {
+        writeDirectory(d, usedInodes, wantedInodes, &opts);
+    }
+
+    uint32_t corrupted = 0;
+    for (uint32_t i = 0; i < usedInodes; i++) {
+        if (randomUnit() < opts.corruptionRate) {
+            corruptInode(i, usedInodes, isDirectoryInode(i, wantedInodes, &opts));
+            corrupted++;
+        }
+    }
+
+    Superblock superblock;
+    memset(&superblock, 0, sizeof(superblock));
+    superblock.magic = VSFS_MAGIC;
+    superblock.blockSize = BLOCK_SIZE;
+    superblock.totalBlocks = opts.totalBlocks;
+    superblock.inodeBitmapBlock = inodeBitmapBlock;
+    superblock.dataBitmapBlock = dataBitmapBlock;
+    superblock.inodeTableStart = inodeTableStart;
+    superblock.dataBlockStart = dataBlockStart;
+    superblock.inodeSize = INODE_SIZE;
+    superblock.inodeCount = opts.inodeCount;
+
+    writeBlocks(0, &superblock, sizeof(superblock));
+    writeBlocks(inodeBitmapBlock, inodeBitmap, inodeBitmapBytes);
+    writeBlocks(dataBitmapBlock, dataBitmap, dataBitmapBytes);
+    writeBlocks(inodeTableStart, inodeTable, inodeTableBytes);
+    close(imageFd);
+
+    fprintf(stderr, "Wrote %s: %u blocks, %u inodes (%u used, %u corrupted), %u data blocks allocated.\n",
+            argv[optind], opts.totalBlocks, opts.inodeCount, usedInodes, corrupted, nextFreeBlock - 1);
+    free(inodeBitmap);
+    free(dataBitmap);
+    free(inodeTable);
+    return EXIT_SUCCESS;
+}
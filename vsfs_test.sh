@@ -0,0 +1,188 @@
+#!/bin/sh
+# Regression tests for the VSFS checker (project_2.c).
+#
+# Builds the checker and the image generator, then checks generated images:
+# clean images (with directory trees under -d) must check clean, corrupted
+# images must check clean after -r, findings about corrupt directory names must
+# be printable, and -r must leave an image whose superblock cannot be trusted
+# byte for byte unchanged. -j, -D, standard input, -R (expanded) and -S (also
+# after an indirect block changed) must report what a serial check reports, triage
+# exit classes must order by severity, and -c must verify what -C recorded. Prints one line per test and exits non-zero if any failed.
+# WORK is the directory for binaries and images.
+set -e
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+if [ -z "$WORK" ]; then
+    WORK=$(mktemp -d)
+    trap 'rm -rf "$WORK"' EXIT
+fi
+SRC=$(cd "$(dirname "$0")" && pwd)
+
+$CC $CFLAGS -o "$WORK/vsfsck" "$SRC/project_2.c" -lpthread
+$CC $CFLAGS -o "$WORK/vsfs_gen" "$SRC/vsfs_gen.c"
+
+failures=0
+
+pass() {
+    echo "ok   $1"
+}
+
+fail() {
+    echo "FAIL $1"
+    failures=$((failures + 1))
+}
+
+# Number of findings the checker reports for an image, from the NDJSON summary
+findings() {
+    image=$1
+    shift
+    "$WORK/vsfsck" -f ndjson "$@" "$image" 2>/dev/null | sed -n 's/.*"type":"summary".*"errors":\([0-9]*\).*/\1/p'
+}
+
+# Overwrites bytes of an image in place; bytes are printf escapes
+patch() {
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# Reads the little-endian 32-bit word at a byte offset of an image
+word() {
+    od -An -tu4 -j "$2" -N4 "$1" | tr -d ' '
+}
+
+# Digest of the text report of an image, to compare runs in different modes
+report() {
+    "$WORK/vsfsck" "$@" 2>/dev/null | md5sum
+}
+
+# Exit status of a check, which set -e would otherwise treat as a failure
+status() {
+    code=0
+    "$WORK/vsfsck" "$@" >/dev/null 2>&1 || code=$?
+    echo "$code"
+}
+
+# Findings of an NDJSON report as one "check inode block" line per inode or block,
+# with runs reported by -R expanded, sorted
+expanded() {
+    "$WORK/vsfsck" -f ndjson "$@" 2>/dev/null | sed -n 's/.*"check":"\([^"]*\)".*"inode":\([0-9a-z]*\),"block":\([0-9a-z]*\),\("count":\([0-9]*\),\)\{0,1\}.*/\1 \2 \3 \5/p' |
+        awk '{ n = $4 == "" ? 1 : $4; for (k = 0; k < n; k++) print $1, $2 == "null" ? $2 : $2 + k, $3 == "null" ? $3 : $3 + k }' | sort
+}
+
+image="$WORK/test.img"
+
+for args in "-d 0" "-d 1 -p 4" "-d 2 -p 8" "-d 3 -p 4"; do
+    # shellcheck disable=SC2086
+    "$WORK/vsfs_gen" -b 16384 -i 4096 $args "$image" 2>/dev/null
+    n=$(findings "$image")
+    if [ "$n" = 0 ]; then pass "clean image ($args)"; else fail "clean image ($args): $n findings"; fi
+done
+
+for seed in 1 2 3 4 5; do
+    for args in "-d 1 -p 4" "-d 2 -p 8" "-d 3 -p 6"; do
+        name="repair seed $seed ($args)"
+        # shellcheck disable=SC2086
+        "$WORK/vsfs_gen" -b 16384 -i 4096 -f 0.7 -c 0.3 -s "$seed" $args "$image" 2>/dev/null
+        before=$(findings "$image")
+        "$WORK/vsfsck" -r "$image" >/dev/null 2>&1
+        after=$(findings "$image")
+        if [ "$before" != 0 ] && [ "$after" = 0 ]; then
+            pass "$name"
+        else
+            fail "$name: $before findings before repair, $after after"
+        fi
+    done
+done
+
+for args in "-t 1" "-t 8 -d 2 -p 4" "-t 126 -d 3 -p 2"; do
+    # shellcheck disable=SC2086
+    "$WORK/vsfs_gen" -b 16384 -i 4096 $args "$image" 2>/dev/null
+    n=$(findings "$image" -d)
+    if [ "$n" = 0 ]; then pass "clean directory tree ($args)"; else fail "clean directory tree ($args): $n findings"; fi
+done
+
+# Corrupted directories hold names of control and non-ASCII bytes, which must be escaped
+"$WORK/vsfs_gen" -b 16384 -i 4096 -t 8 -c 0.3 "$image" 2>/dev/null
+for format in text ndjson; do
+    raw=$("$WORK/vsfsck" -d -f "$format" "$image" 2>/dev/null | LC_ALL=C tr -d '\n -~' | wc -c)
+    if [ "$raw" -eq 0 ]; then pass "escaped directory names ($format)"; else fail "$raw raw bytes in $format output"; fi
+done
+
+# Every mode must report what the serial check of the same corrupted image reports
+for seed in 1 2 3; do
+    "$WORK/vsfs_gen" -b 16384 -i 4096 -f 0.7 -c 0.3 -s "$seed" -d 3 -p 6 "$image" 2>/dev/null
+    serial=$(report "$image")
+    if [ "$(report -j 4 "$image")" = "$serial" ]; then pass "-j 4 (seed $seed)"; else fail "-j 4 (seed $seed) differs from serial"; fi
+    if [ "$(report -D "$image")" = "$serial" ]; then pass "-D (seed $seed)"; else fail "-D (seed $seed) differs from pread"; fi
+    if [ "$(cat "$image" | report -)" = "$serial" ]; then pass "stdin (seed $seed)"; else fail "stdin (seed $seed) differs from file"; fi
+    if [ "$(expanded -R "$image")" = "$(expanded "$image")" ]; then pass "-R (seed $seed)"; else fail "-R (seed $seed) does not expand to the serial findings"; fi
+
+    rm -f "$WORK/state"
+    first=$(report -S "$WORK/state" "$image")
+    second=$(report -S "$WORK/state" "$image")
+    if [ "$first" = "$serial" ] && [ "$second" = "$serial" ]; then pass "-S (seed $seed)"; else fail "-S (seed $seed) differs from a full run"; fi
+
+    # Triage: the worst class of more findings is at least as severe
+    full=$(status -E 1000000 "$image")
+    some=$(status -E 5 "$image")
+    one=$(status -F "$image")
+    if [ "$full" -ge 2 ] && [ "$full" -le "$some" ] && [ "$some" -le "$one" ] && [ "$one" -le 7 ] &&
+        [ "$(findings "$image" -F)" = 1 ] && [ "$(findings "$image" -E 5)" = 5 ]; then
+        pass "triage exit classes (seed $seed)"
+    else
+        fail "triage exit classes (seed $seed): $full with -E 1000000, $some with -E 5, $one with -F"
+    fi
+done
+
+# Superblock fields: inodeTableStart at offset 18, dataBlockStart at 22. Inode fields:
+# direct at offset 40, single indirect at 44
+"$WORK/vsfs_gen" -b 16384 -i 4096 -d 2 -p 8 "$image" 2>/dev/null
+codes="$(status -F "$image") $(status -E 5 "$image") $(status -Q "$image")"
+if [ "$codes" = "0 0 0" ]; then pass "triage exit classes (clean)"; else fail "triage exit classes (clean): $codes"; fi
+tableStart=$(word "$image" 18)
+dataStart=$(word "$image" 22)
+direct=$(word "$image" $((tableStart * 4096 + 40)))
+indirect=$(word "$image" $((tableStart * 4096 + 44)))
+
+rm -f "$WORK/state"
+"$WORK/vsfsck" -S "$WORK/state" "$image" >/dev/null 2>&1
+# Slot 2 of inode 0's single indirect block now points past the data region
+patch "$image" $(((dataStart + indirect) * 4096 + 8)) "\077\102\017\0"
+if [ "$indirect" != 0 ] && [ "$(report -S "$WORK/state" "$image")" = "$(report "$image")" ] &&
+    [ "$(report -S "$WORK/state" "$image")" = "$(report "$image")" ]; then
+    pass "-S after an indirect block changed"
+else
+    fail "-S after an indirect block changed differs from a full run"
+fi
+
+"$WORK/vsfs_gen" -b 16384 -i 4096 -d 2 -p 8 "$image" 2>/dev/null
+"$WORK/vsfsck" -C "$WORK/sums" "$image" >/dev/null 2>&1
+before=$(findings "$image" -c "$WORK/sums")
+patch "$image" $(((dataStart + direct) * 4096)) "\377"
+after=$("$WORK/vsfsck" -f ndjson -c "$WORK/sums" "$image" 2>/dev/null | grep -c '"check":"data-checksum"' || true)
+if [ "$before" = 0 ] && [ "$after" = 1 ]; then
+    pass "checksums recorded with -C verify with -c"
+else
+    fail "checksums recorded with -C: $before findings before a data block changed, $after checksum findings after"
+fi
+rm -f "$WORK/state" "$WORK/sums"
+
+# Superblock: magic (offset 0, 2 bytes), then blockSize and totalBlocks (offset 6).
+# 8192 total blocks still fit the bitmaps of a 4096-block image, so only the file
+# size gives them away
+for corruption in "magic:0:\0\0" "total blocks:6:\0\040\0\0"; do
+    what=${corruption%%:*}
+    rest=${corruption#*:}
+    "$WORK/vsfs_gen" -b 4096 -i 1024 -c 0.3 "$image" 2>/dev/null
+    patch "$image" "${rest%%:*}" "${rest#*:}"
+    cp "$image" "$image.orig"
+    "$WORK/vsfsck" -r "$image" >/dev/null 2>&1
+    if cmp -s "$image" "$image.orig"; then pass "no repair with bad $what"; else fail "repair rewrote image with bad $what"; fi
+done
+rm -f "$image" "$image.orig"
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures test(s) failed"
+    exit 1
+fi
+echo "all tests passed"
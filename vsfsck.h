@@ -0,0 +1,152 @@
+/**
+ * VSFS consistency checker as a library.
+ *
+ * Everything a check derives lives in a VsfsckContext, so any number of contexts
+ * can check images concurrently on different threads; one context checks one
+ * image at a time and keeps its buffers for the next one. Findings and progress
+ * are handed to callbacks instead of being printed. State sized by the image
+ * that does not fit in memory makes vsfsckCheck() fail with ENOMEM; the library
+ * only exits the process when a worker thread or one of its fixed-size buffers
+ * cannot be allocated.
+ *
+ * project_2.c is both the library and the vsfsck command; compile it with
+ * -DVSFSCK_LIBRARY to leave out main() and link it into another program.
+ */
+#ifndef VSFSCK_H
+#define VSFSCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct VsfsckContext VsfsckContext;
+
+typedef enum {
+    VSFSCK_IO_AUTO,
+    VSFSCK_IO_URING,
+    VSFSCK_IO_THREADS,
+} VsfsckIoEngine;
+
+/**
+ * Options that select how one image is checked. vsfsckInitOptions() fills in the
+ * defaults: a full serial check with pread and no side files.
+ */
+typedef struct {
+    bool useMmap;
+    bool repair;
+    // Repeat the check until it saw one consistent state of an image being written
+    bool snapshot;
+    // Threads the inode scan and data checksums are split across, 1 to 1024
+    int jobs;
+    // Incremental state file, read before and rewritten after the check
+    const char *statePath;
+    // Reads kept in flight by the asynchronous reader, up to 4096; 0 for synchronous reads
+    int queueDepth;
+    VsfsckIoEngine ioEngine;
+    bool directories;
+    // Checksum manifests to verify data blocks against and to record
+    const char *verifyChecksums;
+    const char *recordChecksums;
+    // Findings after which checking stops, 0 for no limit
+    uint64_t maxErrors;
+    bool quick;
+    // Read around the page cache with O_DIRECT; ignored for mapped images and streams
+    bool direct;
+    // Report runs of consecutive blocks or inodes with the same bitmap finding as one
+    bool ranges;
+} VsfsckOptions;
+
+/**
+ * One finding. check is the stable check id (e.g. "duplicate-block"); inode and
+ * block are -1 when the finding is not about one. A range finding covers count
+ * consecutive inodes or blocks from the one given; count is 1 otherwise. The
+ * strings are only valid during the callback.
+ */
+typedef struct {
+    const char *check;
+    int64_t inode;
+    int64_t block;
+    uint64_t count;
+    const char *message;
+} VsfsckFinding;
+
+/**
+ * Receivers of a check's output, all called on the thread running vsfsckCheck()
+ * and in report order. finding gets every finding, status the progress and
+ * all-clear lines, and diagnostic the notes about the check itself (fallbacks,
+ * unwritable side files, deep scan throughput). Any of them may be NULL.
+ */
+typedef struct {
+    void (*finding)(void *user, const VsfsckFinding *finding);
+    void (*status)(void *user, const char *message);
+    void (*diagnostic)(void *user, const char *message);
+    void *user;
+} VsfsckCallbacks;
+
+/**
+ * Classes of findings. The worst class of a check is the most severe one found,
+ * i.e. the lowest; the command line uses it as its exit status in triage mode,
+ * where 1 stays reserved for images that could not be checked at all.
+ */
+typedef enum {
+    VSFSCK_FAILURE_NONE = 0,
+    VSFSCK_FAILURE_SUPERBLOCK = 2,
+    VSFSCK_FAILURE_INODE,
+    VSFSCK_FAILURE_BITMAP,
+    VSFSCK_FAILURE_BLOCK,
+    VSFSCK_FAILURE_DIRECTORY,
+    VSFSCK_FAILURE_CHECKSUM
+} VsfsckFailure;
+
+#define VSFSCK_CHECK_COUNT 30
+#define VSFSCK_PHASE_COUNT 9
+
+/**
+ * Wall time and I/O done during one phase. blockReads counts block requests;
+ * cacheHits are the ones served from the mapping, from a completed asynchronous
+ * read or from a hole of a sparse image without a syscall of their own.
+ */
+typedef struct {
+    double seconds;
+    uint64_t blockReads;
+    uint64_t bytesRead;
+    uint64_t cacheHits;
+    uint64_t syscalls;
+} VsfsckPhaseStats;
+
+// Outcome of the last check run on a context
+typedef struct {
+    uint64_t findings;
+    // Findings per check, indexed like vsfsckCheckName()
+    uint64_t counts[VSFSCK_CHECK_COUNT];
+    bool errorLimitReached;
+    VsfsckFailure failure;
+    VsfsckPhaseStats phases[VSFSCK_PHASE_COUNT];
+    // Inode table blocks replayed from the state file, out of inodeTableBlocks
+    uint64_t replayedBlocks;
+    uint32_t inodeTableBlocks;
+} VsfsckReport;
+
+void vsfsckInitOptions(VsfsckOptions *opts);
+
+// Creates a context reporting to callbacks, which are copied; NULL reports nothing.
+VsfsckContext *vsfsckCreate(const VsfsckCallbacks *callbacks);
+
+// Returns why opts cannot be used to check the image at path ("-" for standard input),
+// e.g. a job count or queue depth out of range or repair of a live image, or NULL
+// if they can.
+const char *vsfsckOptionsError(const VsfsckOptions *opts, const char *path);
+
+// Checks the image at path ("-" for standard input). Returns the number of findings,
+// or -1 with errno set if the image could not be opened, as ENOMEM if its state did
+// not fit in memory, or as EINVAL if vsfsckOptionsError() rejects opts.
+int64_t vsfsckCheck(VsfsckContext *ctx, const char *path, const VsfsckOptions *opts);
+
+void vsfsckGetReport(const VsfsckContext *ctx, VsfsckReport *report);
+
+// Stable ids of the checks and names of the phases, for indexes below the counts above
+const char *vsfsckCheckName(int check);
+const char *vsfsckPhaseName(int phase);
+
+void vsfsckDestroy(VsfsckContext *ctx);
+
+#endif